@@ -0,0 +1,152 @@
+// mode: c++; indent-tabs-mode: nil; -*-
+#ifndef libmacro_arena_hh__
+#define libmacro_arena_hh__ 1
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace libmacro {
+namespace detail {
+
+// Memory arena. Memory is allocated sequentially from a list of blocks and released all
+// at once, keeping the blocks for reuse. Deallocated memory is recycled for subsequent
+// allocations of the same size.
+class arena {
+public:
+  arena() : block_(0), used_(0) {}
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+
+  void *
+  allocate(size_t size, size_t align) {
+    // Reuse deallocated memory.
+    for (auto &f : free_) {
+      if (f.size == size && f.head != nullptr) {
+        void *p = f.head;
+        f.head = *static_cast<void **>(p);
+        return p;
+      }
+    }
+
+    for (;;) {
+      if (block_ < blocks_.size()) {
+        size_t offset = (used_ + align - 1) & ~(align - 1);
+        if (offset + size <= blocks_[block_].size) {
+          used_ = offset + size;
+          return blocks_[block_].data.get() + offset;
+        }
+        // Does not fit, continue with the next block.
+        ++block_;
+        used_ = 0;
+      } else {
+        size_t n = blocks_.empty() ? 4096 : blocks_.back().size * 2;
+        while (n < size + align)
+          n *= 2;
+        blocks_.push_back(block{std::unique_ptr<char[]>(new char[n]), n});
+      }
+    }
+  }
+
+  void
+  deallocate(void *p, size_t size) {
+    if (size < sizeof(void *))
+      return;
+    for (auto &f : free_) {
+      if (f.size == size) {
+        *static_cast<void **>(p) = f.head;
+        f.head = p;
+        return;
+      }
+    }
+    *static_cast<void **>(p) = nullptr;
+    free_.push_back(free_list{size, p});
+  }
+
+  // Copy a character sequence into the arena.
+  template<typename InputIterator>
+  char *
+  copy(InputIterator begin, size_t size) {
+    char *p = static_cast<char *>(allocate(size, 1));
+    for (size_t i = 0; i < size; ++i, ++begin)
+      p[i] = *begin;
+    return p;
+  }
+
+  // Get the total size of the blocks.
+  size_t
+  capacity() const {
+    size_t n = 0;
+    for (const auto &b : blocks_)
+      n += b.size;
+    return n;
+  }
+
+  // Release all the allocated memory.
+  void
+  reset() {
+    block_ = 0;
+    used_ = 0;
+    free_.clear();
+  }
+
+private:
+  struct block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  struct free_list {
+    size_t size;
+    void *head;
+  };
+
+  std::vector<block> blocks_;
+  size_t block_;
+  size_t used_;
+  std::vector<free_list> free_;
+};
+
+// Standard allocator interface to an arena.
+template<typename T>
+class arena_allocator {
+public:
+  typedef T value_type;
+
+  explicit arena_allocator(arena &a) : arena_(&a) {}
+
+  template<typename U>
+  arena_allocator(const arena_allocator<U> &other) : arena_(other.arena_) {}
+
+  T *
+  allocate(size_t n) {
+    return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void
+  deallocate(T *p, size_t n) {
+    arena_->deallocate(p, n * sizeof(T));
+  }
+
+  template<typename U>
+  bool
+  operator==(const arena_allocator<U> &other) const {
+    return arena_ == other.arena_;
+  }
+
+  template<typename U>
+  bool
+  operator!=(const arena_allocator<U> &other) const {
+    return arena_ != other.arena_;
+  }
+
+private:
+  template<typename U>
+  friend class arena_allocator;
+
+  arena *arena_;
+};
+
+}  // end namespace detail
+}  // end namespace libmacro
+#endif  // libmacro_arena_hh__
@@ -1,6 +1,9 @@
 // -*- mode: c++; indent-tabs-mode: nil; -*-
 #include "benchmark/benchmark.h"
 #include "libmacro.hh"
+#include "tokenize.hh"
+#include <algorithm>
+#include <mutex>
 #include <string>
 
 namespace {
@@ -24,9 +27,209 @@ BM_macro_replacement(benchmark::State& state) {
         &macros,
         0);
 }
+
+void
+BM_repeated_parameters(benchmark::State& state) {
+  libmacro::macro_table macros;
+  macros.add_define(1, "REP(x) x x x x");
+  macros.add_define(2, "ADD(x,y) ((x)+(y))");
+
+  while (state.KeepRunning())
+    libmacro::macro_expand("REP(REP(REP(REP(ADD(a,ADD(b,c))))))", &macros, 0);
+}
+
+void
+BM_long_expression(benchmark::State& state) {
+  libmacro::macro_table macros;
+  macros.add_define(1, "NEXT(p) ((p)->next)");
+  macros.add_define(2, "LEN(p) ((p)->len)");
+
+  std::string input;
+  for (int i = 0; i < state.range(0); ++i)
+    input += "LEN(NEXT(p)) + ";
+  input += "0";
+
+  while (state.KeepRunning())
+    libmacro::macro_expand(input, &macros, 0);
+}
+
+// Lookup of names, which are mostly not macros, in a table including a chain of headers:
+// plain, flattened, or in a scope.
+void
+BM_include_lookup(benchmark::State& state) {
+  const int depth = 64;
+  struct header : libmacro::included_macros {
+    const libmacro::macro_table *
+    get_macros() const override {
+      return &macros;
+    }
+
+    libmacro::macro_table macros;
+  } headers[depth];
+  for (int i = 0; i < depth; ++i) {
+    std::string n = std::to_string(i);
+    headers[i].macros.add_define(1, "H" + n + " h" + n);
+    if (i + 1 < depth)
+      headers[i].macros.add_include(2, &headers[i + 1]);
+  }
+  libmacro::macro_table macros;
+  macros.add_include(1, &headers[0]);
+  macros.add_define(2, "A H63");
+  if (state.range(0) == 1)
+    macros.flatten();
+
+  const std::string input = "for (i = 0; i < n; ++i) sum += A + H0 * x[i];";
+  libmacro::expansion_context ctx;
+  std::string out;
+  if (state.range(0) == 2) {
+    libmacro::macro_scope scope(&macros, 0);
+    while (state.KeepRunning())
+      ctx.expand(input, scope, out);
+  } else {
+    while (state.KeepRunning())
+      ctx.expand(input, &macros, 0, out);
+  }
+}
+
+// Expansion of nested object-like macros, using a table or a scope.
+void
+BM_object_like(benchmark::State& state) {
+  libmacro::macro_table macros;
+  macros.add_define(1, "PAGE_SHIFT 12");
+  macros.add_define(2, "PAGE_SIZE (1UL << PAGE_SHIFT)");
+  macros.add_define(3, "PAGE_MASK (~(PAGE_SIZE - 1))");
+  macros.add_define(4, "PTE_SHIFT 3");
+  macros.add_define(5, "PTRS_PER_PTE (PAGE_SIZE >> PTE_SHIFT)");
+  macros.add_define(6, "PTE_INDEX_MASK (PTRS_PER_PTE - 1)");
+
+  const std::string input = "((addr & PAGE_MASK) >> PAGE_SHIFT) & PTE_INDEX_MASK";
+  libmacro::macro_scope scope(&macros, 0);
+  libmacro::expansion_context ctx;
+  std::string out;
+  if (state.range(0)) {
+    while (state.KeepRunning())
+      ctx.expand(input, scope, out);
+  } else {
+    while (state.KeepRunning())
+      ctx.expand(input, &macros, 0, out);
+  }
+}
+
+void
+BM_expansion_cache(benchmark::State& state) {
+  libmacro::macro_table macros;
+  macros.add_define(1, "NEXT(p) ((p)->next)");
+  macros.add_define(2, "LEN(p) ((p)->len)");
+  macros.add_define(3, "EMPTY(p) (LEN(p) == 0)");
+
+  const char *watches[] = {
+      "LEN(NEXT(head))", "EMPTY(list)", "NEXT(NEXT(p))->value", "count", "LEN(p) + 1"};
+  libmacro::expansion_cache cache(16);
+  unsigned int lineno = 10;
+  while (state.KeepRunning()) {
+    // Single-step and re-evaluate the watch expressions.
+    ++lineno;
+    for (auto w : watches)
+      benchmark::DoNotOptimize(cache.expand(w, &macros, lineno));
+  }
+}
+
+void
+BM_concurrent_expansion(benchmark::State& state) {
+  static libmacro::macro_table macros;
+  static std::once_flag init;
+  std::call_once(init, [] {
+    macros.add_define(1, "A() D(u,E(u,v))");
+    macros.add_define(2, "B(x) E(x,F(x,v,w))");
+    macros.add_define(3, "C(x) F(x,E(x,v),w)");
+    macros.add_define(4, "D(x,y) F(x,E(x,y),w)");
+    macros.add_define(5, "E(x,y) F(x,y,w).");
+    macros.add_define(6, "F(x,y,z) D(F(x,y,z),E(z,x))");
+  });
+
+  libmacro::expansion_context ctx;
+  std::string out;
+  while (state.KeepRunning())
+    ctx.expand("B(a) C(a) D(e,f) E(f,g) F(g,h,i)", &macros, 0, out);
+}
+
+// Construction of a table from directives in random line order, one by one or in bulk.
+void
+BM_table_construction(benchmark::State& state) {
+  std::vector<std::pair<unsigned int, std::string>> defs;
+  for (int i = 0; i < state.range(1); ++i) {
+    auto n = std::to_string(i);
+    defs.emplace_back(i + 1, "M" + n + "(x) ((x) + " + n + ")");
+  }
+  std::random_shuffle(defs.begin(), defs.end());
+
+  while (state.KeepRunning()) {
+    if (state.range(0)) {
+      libmacro::macro_table_builder builder;
+      for (const auto &d : defs)
+        builder.add_define(d.first, d.second);
+      benchmark::DoNotOptimize(builder.build());
+    } else {
+      libmacro::macro_table macros;
+      for (const auto &d : defs)
+        macros.add_define(d.first, d.second);
+    }
+  }
+}
+
+void
+BM_tokenize(benchmark::State& state) {
+  std::string input;
+  for (int i = 0; i < 1024; ++i)
+    input += "  if (list_entry->next != NULL && count_0 >= 0x1fUL)\n"
+             "    total += (unsigned long) list_entry->value * 3.5e+2; /* sum */\n";
+
+  libmacro::detail::token_list tokens;
+  while (state.KeepRunning()) {
+    tokens.clear();
+    libmacro::detail::tokenize(
+        input.data(), input.data() + input.size(), false, false, tokens);
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+
+void
+BM_expansion_context(benchmark::State& state) {
+  libmacro::macro_table macros;
+  macros.add_define(1, "A() D(u,E(u,v))");
+  macros.add_define(2, "B(x) E(x,F(x,v,w))");
+  macros.add_define(3, "C(x) F(x,E(x,v),w)");
+  macros.add_define(4, "D(x,y) F(x,E(x,y),w)");
+  macros.add_define(5, "E(x,y) F(x,y,w).");
+  macros.add_define(6, "F(x,y,z) D(F(x,y,z),E(z,x))");
+
+  libmacro::expansion_context ctx;
+  std::string out;
+  while (state.KeepRunning())
+    ctx.expand(
+        "B(a) C(a) D(e,f) E(f,g) F(g,h,i)"
+        "B(a) C(a) D(e,f) E(f,g) F(g,h,i)"
+        "B(a) C(a) D(e,f) E(f,g) F(g,h,i)"
+        "B(a) C(a) D(e,f) E(f,g) F(g,h,i)",
+        &macros,
+        0,
+        out);
+}
 }
 
 BENCHMARK(BM_macro_replacement);
+BENCHMARK(BM_repeated_parameters);
+BENCHMARK(BM_long_expression)->Range(8, 512);
+BENCHMARK(BM_include_lookup)->DenseRange(0, 2);
+BENCHMARK(BM_object_like)->Arg(0)->Arg(1);
+BENCHMARK(BM_expansion_cache);
+BENCHMARK(BM_concurrent_expansion)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_table_construction)
+    ->ArgPair(0, 10000)
+    ->ArgPair(1, 10000)
+    ->ArgPair(1, 100000);
+BENCHMARK(BM_tokenize);
+BENCHMARK(BM_expansion_context);
 
 int
 main(int argc, char** argv) {
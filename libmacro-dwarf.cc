@@ -0,0 +1,438 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include "libmacro-dwarf.hh"
+#include <cstring>
+
+namespace libmacro {
+
+namespace {
+
+// Macro information entry types (DWARF4 7.22, DWARF5 7.23).
+enum {
+  DW_MACRO_define = 0x01,
+  DW_MACRO_undef = 0x02,
+  DW_MACRO_start_file = 0x03,
+  DW_MACRO_end_file = 0x04,
+  DW_MACRO_define_strp = 0x05,
+  DW_MACRO_undef_strp = 0x06,
+  DW_MACRO_import = 0x07,
+  // Entries referencing the supplementary object file. The GNU extension has the same
+  // entries with the same codes: DW_MACRO_GNU_define_indirect_alt,
+  // DW_MACRO_GNU_undef_indirect_alt and DW_MACRO_GNU_transparent_include_alt.
+  DW_MACRO_define_sup = 0x08,
+  DW_MACRO_undef_sup = 0x09,
+  DW_MACRO_import_sup = 0x0a,
+  DW_MACRO_define_strx = 0x0b,
+  DW_MACRO_undef_strx = 0x0c,
+  DW_MACINFO_vendor_ext = 0xff
+};
+
+// Flags in the .debug_macro unit header.
+enum {
+  OFFSET_SIZE_FLAG = 0x01,
+  DEBUG_LINE_OFFSET_FLAG = 0x02,
+  OPCODE_OPERANDS_TABLE_FLAG = 0x04
+};
+
+}  // end namespace
+
+// Table of the directives of a source file.
+class dwarf_macro_loader::table : public included_macros {
+public:
+  const macro_table *
+  get_macros() const override {
+    return &macros;
+  }
+
+  macro_table macros;
+};
+
+// Define or undefine directive, referencing the section data.
+struct dwarf_macro_loader::directive {
+  bool define;
+  unsigned int lineno;
+  const char *text;
+  size_t size;
+};
+
+// Directives of an imported unit, in order.
+struct dwarf_macro_loader::imported_unit {
+  imported_unit() : loading(true) {}
+
+  std::vector<directive> directives;
+  // Whether the unit is being loaded.
+  bool loading;
+};
+
+// Sequential reader of a section.
+class dwarf_macro_loader::reader {
+public:
+  reader(const dwarf_section &s, uint64_t offset) : ptr_(s.data), end_(s.data + s.size) {
+    if (offset > s.size)
+      throw "Invalid DWARF section offset";
+    ptr_ += offset;
+  }
+
+  unsigned int
+  u8() {
+    check(1);
+    return *ptr_++;
+  }
+
+  // Read a little-endian value of SIZE bytes.
+  uint64_t
+  fixed(unsigned int size) {
+    check(size);
+    uint64_t v = 0;
+    for (unsigned int i = 0; i < size; ++i)
+      v |= uint64_t(ptr_[i]) << (8 * i);
+    ptr_ += size;
+    return v;
+  }
+
+  uint64_t
+  uleb() {
+    uint64_t v = 0;
+    unsigned int shift = 0;
+    unsigned int b;
+    do {
+      b = u8();
+      if (shift < 64)
+        v |= uint64_t(b & 0x7f) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    return v;
+  }
+
+  // Read a null-terminated string in place.
+  void
+  cstr(const char *&str, size_t &size) {
+    auto nul = static_cast<const unsigned char *>(std::memchr(ptr_, 0, end_ - ptr_));
+    if (nul == nullptr)
+      throw "Truncated DWARF macro information";
+    str = reinterpret_cast<const char *>(ptr_);
+    size = nul - ptr_;
+    ptr_ = nul + 1;
+  }
+
+  void
+  skip(uint64_t size) {
+    check(size);
+    ptr_ += size;
+  }
+
+private:
+  void
+  check(uint64_t size) const {
+    if (uint64_t(end_ - ptr_) < size)
+      throw "Truncated DWARF macro information";
+  }
+
+  const unsigned char *ptr_;
+  const unsigned char *end_;
+};
+
+// State of the loading of a unit.
+struct dwarf_macro_loader::unit_state {
+  unit_state(table *t, const dwarf_section &s)
+      : root(t), import(nullptr), str(&s), offset_size(4), started(false) {}
+
+  // Add a directive to the current source file, or to the imported unit.
+  void
+  add(const directive &d) {
+    if (import != nullptr) {
+      import->directives.push_back(d);
+      return;
+    }
+    auto &macros = current()->macros;
+    if (d.define)
+      macros.add_define_ref(d.lineno, d.text, d.size);
+    else
+      macros.add_undefine(d.lineno, d.text, d.size);
+  }
+
+  // Get the table for the current source file.
+  table *
+  current() const {
+    return open.empty() ? root : tables[open.back()];
+  }
+
+  table *root;
+  // Imported unit, being loaded instead of source files.
+  imported_unit *import;
+  // Strings, referenced by offset from the unit.
+  const dwarf_section *str;
+  dwarf_macro_unit unit;
+  // Tables of the files in the unit.
+  std::vector<table *> tables;
+  // Stack of the files, whose directives are being loaded.
+  std::vector<size_t> open;
+  unsigned int offset_size;
+  // Whether the primary source file was started.
+  bool started;
+  // Operand forms of the opcodes, described in the unit header.
+  std::unordered_map<unsigned int, std::vector<unsigned int>> forms;
+};
+
+namespace {
+
+// Get a null-terminated string at an offset in a section.
+void
+string_at(const dwarf_section &s, uint64_t offset, const char *&str, size_t &size) {
+  if (offset >= s.size)
+    throw "Invalid DWARF string offset";
+  auto p = s.data + offset;
+  auto nul = static_cast<const unsigned char *>(std::memchr(p, 0, s.size - offset));
+  if (nul == nullptr)
+    throw "Invalid DWARF string offset";
+  str = reinterpret_cast<const char *>(p);
+  size = nul - p;
+}
+
+}  // end namespace
+
+dwarf_macro_loader::dwarf_macro_loader(const dwarf_sections &sections)
+    : sections_(sections) {}
+
+dwarf_macro_loader::~dwarf_macro_loader() {}
+
+dwarf_macro_loader::table *
+dwarf_macro_loader::new_table() {
+  tables_.emplace_back(new table);
+  return tables_.back().get();
+}
+
+dwarf_macro_unit
+dwarf_macro_loader::load_macinfo(uint64_t offset) {
+  reader r(sections_.macinfo, offset);
+  unit_state st(new_table(), sections_.str);
+  st.unit.files.push_back(dwarf_macro_file{0, 0, size_t(-1), &st.root->macros});
+  st.tables.push_back(st.root);
+  parse(r, false, 0, st);
+  return std::move(st.unit);
+}
+
+dwarf_macro_unit
+dwarf_macro_loader::load_macro(uint64_t offset, uint64_t str_offsets_base) {
+  reader r(sections_.macro, offset);
+  unit_state st(new_table(), sections_.str);
+  st.unit.files.push_back(dwarf_macro_file{0, 0, size_t(-1), &st.root->macros});
+  st.tables.push_back(st.root);
+  read_header(r, st);
+  parse(r, true, str_offsets_base, st);
+  return std::move(st.unit);
+}
+
+// Get the directives of an imported unit, loading them on first use. They belong to the
+// importing file and are added to its table at their own lines.
+const dwarf_macro_loader::imported_unit &
+dwarf_macro_loader::import(uint64_t offset, uint64_t str_offsets_base, bool sup) {
+  auto &unit = (sup ? sup_imports_ : imports_)[offset];
+  if (unit) {
+    if (unit->loading)
+      throw "Recursive DWARF macro import";
+    return *unit;
+  }
+  unit.reset(new imported_unit);
+
+  reader r(sup ? sections_.sup_macro : sections_.macro, offset);
+  unit_state st(nullptr, sup ? sections_.sup_str : sections_.str);
+  st.import = unit.get();
+  // An imported unit does not contain source files.
+  st.started = true;
+  read_header(r, st);
+  parse(r, true, str_offsets_base, st);
+  unit->loading = false;
+  return *unit;
+}
+
+void
+dwarf_macro_loader::read_header(reader &r, unit_state &st) {
+  auto version = r.fixed(2);
+  if (version != 4 && version != 5)
+    throw "Unsupported DWARF macro information version";
+  auto flags = r.u8();
+  st.offset_size = (flags & OFFSET_SIZE_FLAG) ? 8 : 4;
+  if (flags & DEBUG_LINE_OFFSET_FLAG)
+    r.skip(st.offset_size);
+  if (flags & OPCODE_OPERANDS_TABLE_FLAG) {
+    auto count = r.u8();
+    for (unsigned int i = 0; i < count; ++i) {
+      auto &forms = st.forms[r.u8()];
+      forms.resize(r.uleb());
+      for (auto &f : forms)
+        f = r.u8();
+    }
+  }
+}
+
+// Skip the operands of an opcode, described in the unit header.
+void
+dwarf_macro_loader::skip_operands(reader &r, const unit_state &st, unsigned int op) {
+  auto i = st.forms.find(op);
+  if (i == st.forms.end())
+    throw "Unsupported DWARF macro information entry";
+  const char *str;
+  size_t size;
+  for (auto form : i->second) {
+    switch (form) {
+    case 0x0b:  // DW_FORM_data1
+    case 0x0c:  // DW_FORM_flag
+    case 0x11:  // DW_FORM_ref1
+    case 0x25:  // DW_FORM_strx1
+      r.skip(1);
+      break;
+    case 0x05:  // DW_FORM_data2
+    case 0x12:  // DW_FORM_ref2
+    case 0x26:  // DW_FORM_strx2
+      r.skip(2);
+      break;
+    case 0x27:  // DW_FORM_strx3
+      r.skip(3);
+      break;
+    case 0x06:  // DW_FORM_data4
+    case 0x13:  // DW_FORM_ref4
+    case 0x28:  // DW_FORM_strx4
+      r.skip(4);
+      break;
+    case 0x07:  // DW_FORM_data8
+    case 0x14:  // DW_FORM_ref8
+    case 0x20:  // DW_FORM_ref_sig8
+      r.skip(8);
+      break;
+    case 0x0d:  // DW_FORM_sdata
+    case 0x0f:  // DW_FORM_udata
+    case 0x15:  // DW_FORM_ref_udata
+    case 0x1a:  // DW_FORM_strx
+      r.uleb();
+      break;
+    case 0x08:  // DW_FORM_string
+      r.cstr(str, size);
+      break;
+    case 0x0e:  // DW_FORM_strp
+    case 0x10:  // DW_FORM_ref_addr
+    case 0x17:  // DW_FORM_sec_offset
+    case 0x1f:  // DW_FORM_line_strp
+      r.skip(st.offset_size);
+      break;
+    case 0x0a:  // DW_FORM_block1
+      r.skip(r.u8());
+      break;
+    case 0x03:  // DW_FORM_block2
+      r.skip(r.fixed(2));
+      break;
+    case 0x04:  // DW_FORM_block4
+      r.skip(r.fixed(4));
+      break;
+    case 0x09:  // DW_FORM_block
+      r.skip(r.uleb());
+      break;
+    default:
+      throw "Unsupported DWARF form";
+    }
+  }
+}
+
+// Load the entries of a unit, up to the terminating zero.
+void
+dwarf_macro_loader::parse(reader &r,
+                          bool macro,
+                          uint64_t str_offsets_base,
+                          unit_state &st) {
+  for (;;) {
+    auto op = r.u8();
+    if (op == 0)
+      break;
+    if (!macro && op > DW_MACRO_end_file && op != DW_MACINFO_vendor_ext)
+      throw "Unsupported DWARF macro information entry";
+
+    const char *str;
+    size_t size;
+    switch (op) {
+    case DW_MACRO_define:
+    case DW_MACRO_undef:
+    case DW_MACRO_define_strp:
+    case DW_MACRO_undef_strp:
+    case DW_MACRO_define_strx:
+    case DW_MACRO_undef_strx: {
+      unsigned int lineno = r.uleb();
+      if (op == DW_MACRO_define || op == DW_MACRO_undef) {
+        r.cstr(str, size);
+      } else if (op == DW_MACRO_define_strp || op == DW_MACRO_undef_strp) {
+        string_at(*st.str, r.fixed(st.offset_size), str, size);
+      } else {
+        // Get the string offset from the string offsets table.
+        reader offsets(sections_.str_offsets,
+                       str_offsets_base + r.uleb() * st.offset_size);
+        string_at(sections_.str, offsets.fixed(st.offset_size), str, size);
+      }
+      bool define = op == DW_MACRO_define || op == DW_MACRO_define_strp
+                    || op == DW_MACRO_define_strx;
+      st.add(directive{define, lineno, str, size});
+      break;
+    }
+    case DW_MACRO_start_file: {
+      unsigned int lineno = r.uleb();
+      unsigned int file = r.uleb();
+      if (!st.started) {
+        // The primary source file.
+        st.started = true;
+        st.unit.files[0].file = file;
+        st.open.push_back(0);
+      } else {
+        if (st.import != nullptr)
+          throw "Unexpected start of file in an imported unit";
+        auto *t = new_table();
+        auto parent = st.open.empty() ? 0 : st.open.back();
+        st.current()->macros.add_include(lineno, t);
+        st.unit.files.push_back(dwarf_macro_file{file, lineno, parent, &t->macros});
+        st.tables.push_back(t);
+        st.open.push_back(st.unit.files.size() - 1);
+      }
+      break;
+    }
+    case DW_MACRO_end_file:
+      if (st.open.empty())
+        throw "Unbalanced end of file in DWARF macro information";
+      st.open.pop_back();
+      break;
+    case DW_MACRO_import: {
+      auto offset = r.fixed(st.offset_size);
+      for (const auto &d : import(offset, str_offsets_base, false).directives)
+        st.add(d);
+      break;
+    }
+    case DW_MACRO_define_sup:
+    case DW_MACRO_undef_sup: {
+      // Skipped, unless the supplementary object file is provided.
+      unsigned int lineno = r.uleb();
+      auto offset = r.fixed(st.offset_size);
+      if (sections_.sup_str.size == 0)
+        break;
+      string_at(sections_.sup_str, offset, str, size);
+      st.add(directive{op == DW_MACRO_define_sup, lineno, str, size});
+      break;
+    }
+    case DW_MACRO_import_sup: {
+      auto offset = r.fixed(st.offset_size);
+      if (sections_.sup_macro.size == 0)
+        break;
+      for (const auto &d : import(offset, str_offsets_base, true).directives)
+        st.add(d);
+      break;
+    }
+    case DW_MACINFO_vendor_ext:
+      if (!macro) {
+        r.uleb();
+        r.cstr(str, size);
+        break;
+      }
+      skip_operands(r, st, op);
+      break;
+    default:
+      skip_operands(r, st, op);
+      break;
+    }
+  }
+}
+
+}  // end namespace libmacro
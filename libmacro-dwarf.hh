@@ -0,0 +1,96 @@
+// mode: c++; indent-tabs-mode: nil; -*-
+#ifndef libmacro_dwarf_hh__
+#define libmacro_dwarf_hh__ 1
+
+#include "libmacro.hh"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace libmacro {
+
+// Contents of an object file section.
+struct dwarf_section {
+  const unsigned char *data;
+  size_t size;
+};
+
+// Object file sections, containing macro information. Sections, which are not present,
+// are empty.
+struct dwarf_sections {
+  // DWARF 2-4 macro information.
+  dwarf_section macinfo;
+  // DWARF 5 macro information, or the GNU extension to DWARF 4.
+  dwarf_section macro;
+  // Strings, referenced by the .debug_macro section.
+  dwarf_section str;
+  dwarf_section str_offsets;
+  // Sections of the supplementary object file, e.g. created by dwz, referenced by the
+  // DW_MACRO_*_sup entries. The entries are skipped, if the sections are empty.
+  dwarf_section sup_macro;
+  dwarf_section sup_str;
+};
+
+// A source file, whose macro directives are recorded in a table.
+struct dwarf_macro_file {
+  // Index of the file in the line number information.
+  unsigned int file;
+  // Line of the include directive in the including file.
+  unsigned int lineno;
+  // Index of the including file, or -1 for the primary source file.
+  size_t parent;
+  const macro_table *macros;
+};
+
+// Macro information of a compilation unit.
+struct dwarf_macro_unit {
+  // Source files, in the order of inclusion. The first one is the primary source file,
+  // its table also contains the predefined and the command line macros at line zero.
+  std::vector<dwarf_macro_file> files;
+};
+
+// Loader of macro information from DWARF sections in memory. Multi-byte values are
+// little-endian. The loader owns the created tables, which reference the definitions in
+// the sections: the sections must outlive the loader. Units, imported by DW_MACRO_import,
+// are loaded once and their directives are added to each importing table at their own
+// lines.
+class dwarf_macro_loader {
+public:
+  _LIBMACRO_EXPORT explicit dwarf_macro_loader(const dwarf_sections &);
+  _LIBMACRO_EXPORT ~dwarf_macro_loader();
+  dwarf_macro_loader(const dwarf_macro_loader &) = delete;
+  dwarf_macro_loader &operator=(const dwarf_macro_loader &) = delete;
+
+  // Load the macro information of a unit from .debug_macinfo at OFFSET, the value of the
+  // DW_AT_macro_info attribute.
+  _LIBMACRO_EXPORT dwarf_macro_unit load_macinfo(uint64_t offset);
+
+  // Load the macro information of a unit from .debug_macro at OFFSET, the value of the
+  // DW_AT_macros or DW_AT_GNU_macros attribute. STR_OFFSETS_BASE is the value of the
+  // DW_AT_str_offsets_base attribute of the unit.
+  _LIBMACRO_EXPORT dwarf_macro_unit load_macro(uint64_t offset,
+                                               uint64_t str_offsets_base = 0);
+
+private:
+  class table;
+  class reader;
+  struct directive;
+  struct imported_unit;
+  struct unit_state;
+
+  table *new_table();
+  const imported_unit &import(uint64_t, uint64_t, bool);
+  void read_header(reader &, unit_state &);
+  void skip_operands(reader &, const unit_state &, unsigned int);
+  void parse(reader &, bool, uint64_t, unit_state &);
+
+  dwarf_sections sections_;
+  std::vector<std::unique_ptr<table>> tables_;
+  // Imported units, by section offset, from this and from the supplementary object file.
+  std::unordered_map<uint64_t, std::unique_ptr<imported_unit>> imports_;
+  std::unordered_map<uint64_t, std::unique_ptr<imported_unit>> sup_imports_;
+};
+
+}  // end namespace libmacro
+#endif  // libmacro_dwarf_hh__
@@ -0,0 +1,601 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include "libmacro-image.hh"
+#include "tokenize.hh"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace libmacro {
+
+// Image layout. All the records consist of 32-bit words; offsets are from the start of
+// the image.
+struct macro_image::header {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint32_t size;
+  // Array of string records.
+  uint32_t strings, string_count;
+  // Array of define records.
+  uint32_t defines, define_count;
+  // Array of table records.
+  uint32_t tables, table_count;
+  // Array of name records for all the names in the image, ordered by hash.
+  uint32_t names, name_count;
+};
+
+namespace {
+
+const char image_magic[8] = {'L', 'I', 'B', 'M', 'A', 'C', 'R', 'O'};
+const uint32_t image_byte_order = 0x01020304;
+const uint32_t image_version = 1;
+
+// Null-terminated text in the image.
+struct string_record {
+  uint32_t offset;
+  uint32_t size;
+};
+
+struct define_record {
+  uint32_t name;
+  uint32_t repl;
+  // Array of string numbers of the parameters.
+  uint32_t params, param_count;
+};
+
+struct table_record {
+  // Array of name records, ordered by hash.
+  uint32_t names, name_count;
+  // Array of include records, ordered by line.
+  uint32_t includes, include_count;
+};
+
+struct name_record {
+  uint32_t hash;
+  uint32_t name;
+  // Array of version records, ordered by line.
+  uint32_t versions, version_count;
+};
+
+// A define directive, with DEFINE being one plus the number of the define record, or an
+// undefine directive, with DEFINE being zero.
+struct version_record {
+  uint32_t lineno;
+  uint32_t seq;
+  uint32_t define;
+};
+
+struct include_record {
+  uint32_t lineno;
+  uint32_t seq;
+  uint32_t table;
+};
+
+uint32_t
+name_hash(string_ref name) {
+  return static_cast<uint32_t>(detail::string_ref_hash()(name));
+}
+
+// Find the first of the records, which may be for a name with the given hash.
+template<typename T>
+const T *
+find_by_hash(const T *begin, const T *end, uint32_t hash) {
+  return std::lower_bound(
+      begin, end, hash, [](const T &r, uint32_t h) { return r.hash < h; });
+}
+
+// Find the first record with a line number not less than LINENO, or the end, if LINENO
+// is zero.
+template<typename T>
+const T *
+find_by_lineno(const T *begin, const T *end, unsigned int lineno) {
+  if (lineno == 0)
+    return end;
+  return std::lower_bound(
+      begin, end, lineno, [](const T &r, unsigned int l) { return r.lineno < l; });
+}
+
+// Builder of an image.
+class image_writer {
+public:
+  explicit image_writer(std::string &out) : out_(out), base_(out.size()) {}
+
+  // Append words to the image and return the offset of the first one.
+  uint32_t
+  append(const uint32_t *words, size_t count) {
+    auto offset = out_.size() - base_;
+    out_.append(reinterpret_cast<const char *>(words), count * sizeof(uint32_t));
+    if (out_.size() - base_ > UINT32_MAX)
+      throw "Macro image too large";
+    return static_cast<uint32_t>(offset);
+  }
+
+  template<typename T>
+  uint32_t
+  append(const std::vector<T> &records) {
+    static_assert(sizeof(T) % sizeof(uint32_t) == 0, "Records must consist of words");
+    return append(reinterpret_cast<const uint32_t *>(records.data()),
+                  records.size() * sizeof(T) / sizeof(uint32_t));
+  }
+
+  // Get the number of a string, adding it, if necessary.
+  uint32_t
+  add_string(const std::string &s) {
+    auto i = string_index_.find(s);
+    if (i != string_index_.end())
+      return i->second;
+    auto n = static_cast<uint32_t>(strings_.size());
+    string_index_.emplace(s, n);
+    strings_.push_back(string_record{0, static_cast<uint32_t>(s.size())});
+    texts_.push_back(&string_index_.find(s)->first);
+    return n;
+  }
+
+  // Append the text of the strings and the string records.
+  uint32_t
+  append_strings() {
+    for (size_t i = 0; i < strings_.size(); ++i) {
+      strings_[i].offset = static_cast<uint32_t>(out_.size() - base_);
+      out_.append(texts_[i]->c_str(), texts_[i]->size() + 1);
+      out_.resize(base_ + (out_.size() - base_ + 3) / 4 * 4);
+    }
+    return append(strings_);
+  }
+
+  size_t
+  string_count() const {
+    return strings_.size();
+  }
+
+  size_t
+  base() const {
+    return base_;
+  }
+
+private:
+  std::string &out_;
+  size_t base_;
+  std::vector<string_record> strings_;
+  std::vector<const std::string *> texts_;
+  std::unordered_map<std::string, uint32_t> string_index_;
+};
+
+}  // end namespace
+
+// Slots for the definitions of consecutive define records.
+struct macro_image::define_chunk {
+  static const uint32_t size = 1024;
+
+  define_chunk() {
+    for (auto &d : defines)
+      d.store(nullptr, std::memory_order_relaxed);
+  }
+
+  ~define_chunk() {
+    for (auto &d : defines)
+      delete d.load(std::memory_order_relaxed);
+  }
+
+  std::atomic<macro_table::define *> defines[size];
+};
+
+// Chain of the tables, whose lookup is in progress.
+struct macro_image::search_path {
+  uint32_t table;
+  const search_path *next;
+};
+
+void
+macro_image::write(const std::vector<const macro_table *> &roots, std::string &out) {
+  // Number the tables, the given ones first.
+  std::vector<const macro_table *> tables;
+  std::unordered_map<const macro_table *, uint32_t> table_index;
+  auto add_table = [&](const macro_table *t) {
+    if (table_index.emplace(t, tables.size()).second)
+      tables.push_back(t);
+  };
+  for (auto *t : roots)
+    add_table(t);
+  for (size_t i = 0; i < tables.size(); ++i) {
+    for (const auto &inc : tables[i]->includes_)
+      add_table(inc.include->get_macros());
+  }
+
+  // Reserve the space for the header.
+  image_writer w(out);
+  header h;
+  std::memset(&h, 0, sizeof(h));
+  w.append(reinterpret_cast<const uint32_t *>(&h), sizeof(h) / sizeof(uint32_t));
+
+  // Collect the definitions and the names.
+  std::vector<define_record> defines;
+  std::unordered_map<const macro_table::define *, uint32_t> define_index;
+  std::vector<uint32_t> params;
+  std::vector<std::vector<name_record>> table_names(tables.size());
+  std::vector<std::vector<version_record>> versions;
+  std::unordered_map<uint32_t, uint32_t> all_names;
+  for (size_t i = 0; i < tables.size(); ++i) {
+    // Names of the undefined macros, taken from the directives on demand.
+    std::unordered_map<detail::symbol, std::string> undefined;
+    for (const auto &n : tables[i]->index_) {
+      if (n.second.empty())
+        continue;
+      versions.emplace_back();
+      const std::string *name = nullptr;
+      for (const auto &v : n.second) {
+        uint32_t def = 0;
+        if (v.def != nullptr) {
+          auto d = define_index.find(v.def);
+          if (d == define_index.end()) {
+            define_record r;
+            r.name = w.add_string(v.def->name());
+            r.repl = w.add_string(v.def->repl());
+            r.params = static_cast<uint32_t>(params.size());
+            r.param_count = static_cast<uint32_t>(v.def->params().size());
+            for (const auto &p : v.def->params())
+              params.push_back(w.add_string(p));
+            d = define_index.emplace(v.def, defines.size()).first;
+            defines.push_back(r);
+          }
+          def = d->second + 1;
+          name = &v.def->name();
+        }
+        versions.back().push_back(
+            version_record{v.lineno, static_cast<uint32_t>(v.seq), def});
+      }
+      if (name == nullptr) {
+        if (undefined.empty()) {
+          const auto *t = tables[i];
+          for (size_t j = 0; j < t->lines_.size(); ++j) {
+            if (t->kinds_[j] != macro_table::UNDEFINE)
+              continue;
+            auto *u = static_cast<const macro_table::undefine *>(t->items_[j]);
+            std::string s(u->name, u->size);
+            auto sym = detail::find_symbol(s);
+            undefined.emplace(sym, std::move(s));
+          }
+        }
+        name = &undefined[n.first];
+      }
+      auto s = w.add_string(*name);
+      auto hash = name_hash(*name);
+      all_names.emplace(s, hash);
+      // The versions are appended later, the offset is temporarily their index.
+      table_names[i].push_back(
+          name_record{hash, s, static_cast<uint32_t>(versions.size() - 1), 0});
+    }
+  }
+
+  // Append the arrays and fix up the offsets.
+  for (auto &r : defines)
+    r.params = w.append(params.data() + r.params, r.param_count);
+  std::vector<table_record> table_records;
+  for (size_t i = 0; i < tables.size(); ++i) {
+    auto &names = table_names[i];
+    for (auto &n : names) {
+      const auto &v = versions[n.versions];
+      n.versions = w.append(v);
+      n.version_count = static_cast<uint32_t>(v.size());
+    }
+    std::sort(names.begin(), names.end(), [](const name_record &a, const name_record &b) {
+      return a.hash < b.hash;
+    });
+    std::vector<include_record> includes;
+    for (const auto &inc : tables[i]->includes_) {
+      includes.push_back(include_record{inc.lineno,
+                                        static_cast<uint32_t>(inc.seq),
+                                        table_index[inc.include->get_macros()]});
+    }
+    table_record r;
+    r.names = w.append(names);
+    r.name_count = static_cast<uint32_t>(names.size());
+    r.includes = w.append(includes);
+    r.include_count = static_cast<uint32_t>(includes.size());
+    table_records.push_back(r);
+  }
+  std::vector<name_record> names;
+  for (const auto &n : all_names)
+    names.push_back(name_record{n.second, n.first, 0, 0});
+  std::sort(names.begin(), names.end(), [](const name_record &a, const name_record &b) {
+    return a.hash < b.hash;
+  });
+
+  std::memcpy(h.magic, image_magic, sizeof(h.magic));
+  h.byte_order = image_byte_order;
+  h.version = image_version;
+  h.string_count = static_cast<uint32_t>(w.string_count());
+  h.strings = w.append_strings();
+  h.define_count = static_cast<uint32_t>(defines.size());
+  h.defines = w.append(defines);
+  h.table_count = static_cast<uint32_t>(table_records.size());
+  h.tables = w.append(table_records);
+  h.name_count = static_cast<uint32_t>(names.size());
+  h.names = w.append(names);
+  h.size = static_cast<uint32_t>(out.size() - w.base());
+  std::memcpy(&out[w.base()], &h, sizeof(h));
+}
+
+macro_image::macro_image(const void *data, size_t size)
+    : data_(static_cast<const unsigned char *>(data)),
+      size_(size),
+      header_(nullptr),
+      mapping_(nullptr) {
+  if (reinterpret_cast<uintptr_t>(data) % sizeof(uint32_t) != 0)
+    throw "Misaligned macro image";
+  if (size < sizeof(header))
+    throw "Invalid macro image";
+  header_ = static_cast<const header *>(data);
+  if (std::memcmp(header_->magic, image_magic, sizeof(image_magic)) != 0
+      || header_->byte_order != image_byte_order)
+    throw "Invalid macro image";
+  if (header_->version != image_version)
+    throw "Unsupported macro image version";
+  if (header_->size > size)
+    throw "Truncated macro image";
+  // Check the arrays are within the image.
+  at(header_->strings, header_->string_count, sizeof(string_record));
+  at(header_->defines, header_->define_count, sizeof(define_record));
+  at(header_->tables, header_->table_count, sizeof(table_record));
+  at(header_->names, header_->name_count, sizeof(name_record));
+  auto chunks = chunk_count();
+  defines_.reset(new std::atomic<define_chunk *>[chunks]);
+  for (uint32_t i = 0; i < chunks; ++i)
+    defines_[i].store(nullptr, std::memory_order_relaxed);
+}
+
+macro_image::~macro_image() {
+  for (uint32_t i = 0; i < chunk_count(); ++i)
+    delete defines_[i].load(std::memory_order_relaxed);
+#ifndef _WIN32
+  if (mapping_ != nullptr)
+    munmap(mapping_, size_);
+#endif
+}
+
+std::unique_ptr<macro_image>
+macro_image::map(const char *path) {
+#ifdef _WIN32
+  (void)path;
+  throw "Mapping macro images is not supported";
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    throw "Cannot open macro image";
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw "Cannot open macro image";
+  }
+  size_t size = st.st_size;
+  void *p = size == 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    throw "Cannot map macro image";
+  std::unique_ptr<macro_image> image;
+  try {
+    image.reset(new macro_image(p, size));
+  } catch (...) {
+    munmap(p, size);
+    throw;
+  }
+  image->mapping_ = p;
+  return image;
+#endif
+}
+
+size_t
+macro_image::size() const {
+  return header_->table_count;
+}
+
+// Get a pointer to an array of COUNT records of SIZE bytes, checking it is within the
+// image.
+const void *
+macro_image::at(uint32_t offset, uint32_t count, size_t size) const {
+  if (offset % sizeof(uint32_t) != 0 || offset > header_->size
+      || (header_->size - offset) / size < count)
+    throw "Invalid macro image";
+  return data_ + offset;
+}
+
+string_ref
+macro_image::string_at(uint32_t n) const {
+  if (n >= header_->string_count)
+    throw "Invalid macro image";
+  const auto &s = static_cast<const string_record *>(
+      at(header_->strings, header_->string_count, sizeof(string_record)))[n];
+  return string_ref(static_cast<const char *>(at(s.offset, s.size, 1)), s.size);
+}
+
+uint32_t
+macro_image::chunk_count() const {
+  return (header_->define_count + define_chunk::size - 1) / define_chunk::size;
+}
+
+// Get the definition for a define record, creating it on first use.
+const macro_table::define *
+macro_image::get_define(uint32_t n) const {
+  if (n >= header_->define_count)
+    throw "Invalid macro image";
+  // Allocate the slots of the chunk on first use.
+  auto &chunk = defines_[n / define_chunk::size];
+  auto *c = chunk.load(std::memory_order_acquire);
+  if (c == nullptr) {
+    std::unique_ptr<define_chunk> fresh(new define_chunk);
+    if (chunk.compare_exchange_strong(
+            c, fresh.get(), std::memory_order_acq_rel, std::memory_order_acquire))
+      c = fresh.release();
+  }
+  auto &slot = c->defines[n % define_chunk::size];
+  if (auto *d = slot.load(std::memory_order_acquire))
+    return d;
+
+  // Create the definition already parsed, from the parts in the record.
+  const auto &r = static_cast<const define_record *>(
+      at(header_->defines, header_->define_count, sizeof(define_record)))[n];
+  std::unique_ptr<detail::macro_def> parts(new detail::macro_def);
+  auto name = string_at(r.name);
+  parts->name.assign(name.begin(), name.end());
+  auto params =
+      static_cast<const uint32_t *>(at(r.params, r.param_count, sizeof(uint32_t)));
+  parts->params.reserve(r.param_count);
+  for (uint32_t i = 0; i < r.param_count; ++i) {
+    auto p = string_at(params[i]);
+    parts->params.emplace_back(p.begin(), p.end());
+  }
+  auto repl = string_at(r.repl);
+  parts->repl.assign(repl.begin(), repl.end());
+  std::unique_ptr<macro_table::define> d(new macro_table::define);
+  d->def.store(parts.release(), std::memory_order_relaxed);
+
+  // Another thread may have created the definition in the meantime.
+  macro_table::define *expected = nullptr;
+  if (slot.compare_exchange_strong(
+          expected, d.get(), std::memory_order_acq_rel, std::memory_order_acquire))
+    return d.release();
+  return expected;
+}
+
+const macro_table::define *
+macro_image::find_define(size_t table, unsigned int lineno, string_ref name) const {
+  if (table >= header_->table_count)
+    throw "Invalid macro table number";
+
+  // Reject the names, not defined anywhere in the image.
+  auto hash = name_hash(name);
+  auto *names = static_cast<const name_record *>(
+      at(header_->names, header_->name_count, sizeof(name_record)));
+  auto *end = names + header_->name_count;
+  auto i = find_by_hash(names, end, hash);
+  while (i != end && i->hash == hash && string_at(i->name) != name)
+    ++i;
+  if (i == end || i->hash != hash)
+    return nullptr;
+
+  return find_define(static_cast<uint32_t>(table), lineno, hash, i->name, nullptr);
+}
+
+// Find the definition of the name, which is string number N with hash HASH, mirroring
+// macro_table::find_define.
+const macro_table::define *
+macro_image::find_define(uint32_t table,
+                         unsigned int lineno,
+                         uint32_t hash,
+                         uint32_t n,
+                         const search_path *path) const {
+  // Protect from cycles in the incuded files.
+  for (auto p = path; p != nullptr; p = p->next) {
+    if (p->table == table)
+      return nullptr;
+  }
+  const search_path here{table, path};
+
+  if (table >= header_->table_count)
+    throw "Invalid macro image";
+  const auto &t = static_cast<const table_record *>(
+      at(header_->tables, header_->table_count, sizeof(table_record)))[table];
+
+  // Find the last define or undefine directive for the name, preceding the given line.
+  const version_record *v = nullptr;
+  auto *names = static_cast<const name_record *>(
+      at(t.names, t.name_count, sizeof(name_record)));
+  auto *names_end = names + t.name_count;
+  for (auto i = find_by_hash(names, names_end, hash); i != names_end && i->hash == hash;
+       ++i) {
+    if (i->name != n)
+      continue;
+    auto *versions = static_cast<const version_record *>(
+        at(i->versions, i->version_count, sizeof(version_record)));
+    auto j = find_by_lineno(versions, versions + i->version_count, lineno);
+    if (j != versions)
+      v = j - 1;
+    break;
+  }
+
+  // Search among the directives in the files, included after that directive, starting
+  // from the latest one.
+  auto *includes = static_cast<const include_record *>(
+      at(t.includes, t.include_count, sizeof(include_record)));
+  auto i = find_by_lineno(includes, includes + t.include_count, lineno);
+  while (i != includes) {
+    --i;
+    if (v != nullptr
+        && (i->lineno < v->lineno || (i->lineno == v->lineno && i->seq < v->seq)))
+      break;
+    if (const auto *d = find_define(i->table, 0, hash, n, &here))
+      return d;
+  }
+
+  if (v != nullptr && v->define != 0)
+    return get_define(v->define - 1);
+  return nullptr;
+}
+
+namespace {
+
+// Definitions, visible at a line of a table in an image.
+class image_source : public detail::definition_source {
+public:
+  image_source(const macro_image &image, size_t table, unsigned int lineno)
+      : image_(image), table_(table), lineno_(lineno) {}
+
+  const macro_table::define *
+  find_define(string_ref name) const override {
+    return image_.find_define(table_, lineno_, name);
+  }
+
+private:
+  const macro_image &image_;
+  size_t table_;
+  unsigned int lineno_;
+};
+
+}  // end namespace
+
+void
+expansion_context::expand(string_ref in,
+                          const macro_image &image,
+                          size_t table,
+                          unsigned int lineno,
+                          std::string &out) {
+  expand(in, image_source(image, table, lineno), out);
+}
+
+void
+expansion_context::expand(string_ref in,
+                          const macro_image &image,
+                          size_t table,
+                          unsigned int lineno,
+                          expansion_sink &out) {
+  expand(in, image_source(image, table, lineno), out);
+}
+
+std::string
+macro_expand(string_ref in,
+             const macro_image &image,
+             size_t table,
+             unsigned int lineno) {
+  expansion_context ctx;
+  std::string out;
+  ctx.expand(in, image, table, lineno, out);
+  return out;
+}
+
+void
+macro_expand(string_ref in,
+             const macro_image &image,
+             size_t table,
+             unsigned int lineno,
+             expansion_sink &out) {
+  expansion_context ctx;
+  ctx.expand(in, image, table, lineno, out);
+}
+
+}  // end namespace libmacro
@@ -0,0 +1,82 @@
+// mode: c++; indent-tabs-mode: nil; -*-
+#ifndef libmacro_image_hh__
+#define libmacro_image_hh__ 1
+
+#include "libmacro.hh"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace libmacro {
+
+// Read-only view of a set of macro tables, serialized in a binary image. The image is
+// used in place, e.g. mapped from a file: opening it takes time independent of the
+// number of directives, except for one pointer per 1024 definitions, and the macro
+// definitions are created only when first looked up.
+// The image has the byte order of the host, which wrote it.
+class macro_image {
+public:
+  // Use an image in memory, which must outlive this object and be 4-byte aligned.
+  _LIBMACRO_EXPORT macro_image(const void *data, size_t size);
+
+  _LIBMACRO_EXPORT ~macro_image();
+  macro_image(const macro_image &) = delete;
+  macro_image &operator=(const macro_image &) = delete;
+
+  // Map an image from the file PATH. Not supported on Windows.
+  _LIBMACRO_EXPORT static std::unique_ptr<macro_image> map(const char *path);
+
+  // Serialize the tables and append the image to OUT. The tables are numbered in the
+  // order given, followed by the tables they include, which are not given.
+  _LIBMACRO_EXPORT static void write(const std::vector<const macro_table *> &tables,
+                                     std::string &out);
+
+  // Get the number of tables in the image.
+  _LIBMACRO_EXPORT size_t size() const;
+
+  // Find the definition of NAME, visible at line LINENO of table TABLE, the same way as
+  // macro_table::find_define.
+  _LIBMACRO_EXPORT const macro_table::define *find_define(size_t table,
+                                                          unsigned int lineno,
+                                                          string_ref name) const;
+
+private:
+  struct header;
+  struct define_chunk;
+  struct search_path;
+
+  const void *at(uint32_t offset, uint32_t count, size_t size) const;
+  string_ref string_at(uint32_t) const;
+  const macro_table::define *find_define(uint32_t,
+                                         unsigned int,
+                                         uint32_t,
+                                         uint32_t,
+                                         const search_path *) const;
+  uint32_t chunk_count() const;
+  const macro_table::define *get_define(uint32_t) const;
+
+  const unsigned char *data_;
+  size_t size_;
+  const header *header_;
+  // Definitions, created on first use, in chunks, also allocated on first use.
+  std::unique_ptr<std::atomic<define_chunk *>[]> defines_;
+  // Mapping, owned by the image.
+  void *mapping_;
+};
+
+// Macro expand INPUT, using the macros, visible at line LINENO of table TABLE of IMAGE.
+std::string macro_expand(string_ref input,
+                         const macro_image &image,
+                         size_t table,
+                         unsigned int lineno);
+
+// Macro expand INPUT, as above, and pass the result to OUT.
+void macro_expand(string_ref input,
+                  const macro_image &image,
+                  size_t table,
+                  unsigned int lineno,
+                  expansion_sink &out);
+
+}  // end namespace libmacro
+#endif  // libmacro_image_hh__
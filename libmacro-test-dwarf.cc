@@ -0,0 +1,165 @@
+#include "libmacro-dwarf.hh"
+#include "gtest/gtest.h"
+
+namespace {
+
+// The test data is produced by compiling:
+//
+// t.c:
+//   #define FOO 1
+//   #include "defs.h"
+//   #define BAR(a, b) (a + b)
+//   #undef FOO
+//   int main(void) { return SQUARE(LIMIT) + BAR(1, 2); }
+//
+// defs.h:
+//   #define SQUARE(x) ((x) * (x))
+//   #define LIMIT 10
+//   #undef LIMIT
+//   #define LIMIT 20
+
+// .debug_macinfo from gcc -g3 -gdwarf-4 -gstrict-dwarf -undef -nostdinc -c t.c
+const unsigned char macinfo[] = {
+    0x01, 0x00, 0x5f, 0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f, 0x5f, 0x20, 0x31,
+    0x00, 0x01, 0x00, 0x5f, 0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f, 0x56, 0x45,
+    0x52, 0x53, 0x49, 0x4f, 0x4e, 0x5f, 0x5f, 0x20, 0x32, 0x30, 0x31, 0x37,
+    0x31, 0x30, 0x4c, 0x00, 0x01, 0x00, 0x5f, 0x5f, 0x53, 0x54, 0x44, 0x43,
+    0x5f, 0x55, 0x54, 0x46, 0x5f, 0x31, 0x36, 0x5f, 0x5f, 0x20, 0x31, 0x00,
+    0x01, 0x00, 0x5f, 0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f, 0x55, 0x54, 0x46,
+    0x5f, 0x33, 0x32, 0x5f, 0x5f, 0x20, 0x31, 0x00, 0x01, 0x00, 0x5f, 0x5f,
+    0x53, 0x54, 0x44, 0x43, 0x5f, 0x48, 0x4f, 0x53, 0x54, 0x45, 0x44, 0x5f,
+    0x5f, 0x20, 0x31, 0x00, 0x03, 0x00, 0x01, 0x01, 0x01, 0x46, 0x4f, 0x4f,
+    0x20, 0x31, 0x00, 0x03, 0x02, 0x02, 0x01, 0x01, 0x53, 0x51, 0x55, 0x41,
+    0x52, 0x45, 0x28, 0x78, 0x29, 0x20, 0x28, 0x28, 0x78, 0x29, 0x20, 0x2a,
+    0x20, 0x28, 0x78, 0x29, 0x29, 0x00, 0x01, 0x02, 0x4c, 0x49, 0x4d, 0x49,
+    0x54, 0x20, 0x31, 0x30, 0x00, 0x02, 0x03, 0x4c, 0x49, 0x4d, 0x49, 0x54,
+    0x00, 0x01, 0x04, 0x4c, 0x49, 0x4d, 0x49, 0x54, 0x20, 0x32, 0x30, 0x00,
+    0x04, 0x01, 0x03, 0x42, 0x41, 0x52, 0x28, 0x61, 0x2c, 0x62, 0x29, 0x20,
+    0x28, 0x61, 0x20, 0x2b, 0x20, 0x62, 0x29, 0x00, 0x02, 0x04, 0x46, 0x4f,
+    0x4f, 0x00, 0x04, 0x00,
+};
+
+// .debug_macro and .debug_str from gcc -g3 -gdwarf-5 -undef -nostdinc t.c
+const unsigned char macro[] = {
+    0x05, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x07, 0x2c, 0x00, 0x00, 0x00,
+    0x03, 0x00, 0x01, 0x05, 0x01, 0xd8, 0x00, 0x00, 0x00, 0x03, 0x02, 0x02,
+    0x07, 0x4e, 0x00, 0x00, 0x00, 0x04, 0x05, 0x03, 0x12, 0x00, 0x00, 0x00,
+    0x02, 0x04, 0x46, 0x4f, 0x4f, 0x00, 0x04, 0x00, 0x05, 0x00, 0x00, 0x05,
+    0x00, 0x54, 0x00, 0x00, 0x00, 0x05, 0x00, 0x35, 0x00, 0x00, 0x00, 0x05,
+    0x00, 0x23, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05,
+    0x00, 0x5f, 0x00, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x05, 0x01, 0xde,
+    0x00, 0x00, 0x00, 0x05, 0x02, 0xf4, 0x00, 0x00, 0x00, 0x06, 0x03, 0x4e,
+    0x00, 0x00, 0x00, 0x05, 0x04, 0xfd, 0x00, 0x00, 0x00, 0x00,
+};
+
+const unsigned char str[] = {
+    0x5f, 0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f, 0x55, 0x54, 0x46, 0x5f, 0x33,
+    0x32, 0x5f, 0x5f, 0x20, 0x31, 0x00, 0x42, 0x41, 0x52, 0x28, 0x61, 0x2c,
+    0x62, 0x29, 0x20, 0x28, 0x61, 0x20, 0x2b, 0x20, 0x62, 0x29, 0x00, 0x5f,
+    0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f, 0x55, 0x54, 0x46, 0x5f, 0x31, 0x36,
+    0x5f, 0x5f, 0x20, 0x31, 0x00, 0x5f, 0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f,
+    0x56, 0x45, 0x52, 0x53, 0x49, 0x4f, 0x4e, 0x5f, 0x5f, 0x20, 0x32, 0x30,
+    0x31, 0x37, 0x31, 0x30, 0x4c, 0x00, 0x4c, 0x49, 0x4d, 0x49, 0x54, 0x00,
+    0x5f, 0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f, 0x5f, 0x20, 0x31, 0x00, 0x5f,
+    0x5f, 0x53, 0x54, 0x44, 0x43, 0x5f, 0x48, 0x4f, 0x53, 0x54, 0x45, 0x44,
+    0x5f, 0x5f, 0x20, 0x31, 0x00, 0x47, 0x4e, 0x55, 0x20, 0x43, 0x31, 0x37,
+    0x20, 0x31, 0x32, 0x2e, 0x32, 0x2e, 0x30, 0x20, 0x2d, 0x6d, 0x74, 0x75,
+    0x6e, 0x65, 0x3d, 0x67, 0x65, 0x6e, 0x65, 0x72, 0x69, 0x63, 0x20, 0x2d,
+    0x6d, 0x61, 0x72, 0x63, 0x68, 0x3d, 0x78, 0x38, 0x36, 0x2d, 0x36, 0x34,
+    0x20, 0x2d, 0x67, 0x33, 0x20, 0x2d, 0x67, 0x64, 0x77, 0x61, 0x72, 0x66,
+    0x2d, 0x35, 0x20, 0x2d, 0x4f, 0x30, 0x20, 0x2d, 0x75, 0x6e, 0x64, 0x65,
+    0x66, 0x20, 0x2d, 0x66, 0x61, 0x73, 0x79, 0x6e, 0x63, 0x68, 0x72, 0x6f,
+    0x6e, 0x6f, 0x75, 0x73, 0x2d, 0x75, 0x6e, 0x77, 0x69, 0x6e, 0x64, 0x2d,
+    0x74, 0x61, 0x62, 0x6c, 0x65, 0x73, 0x00, 0x6d, 0x61, 0x69, 0x6e, 0x00,
+    0x46, 0x4f, 0x4f, 0x20, 0x31, 0x00, 0x53, 0x51, 0x55, 0x41, 0x52, 0x45,
+    0x28, 0x78, 0x29, 0x20, 0x28, 0x28, 0x78, 0x29, 0x20, 0x2a, 0x20, 0x28,
+    0x78, 0x29, 0x29, 0x00, 0x4c, 0x49, 0x4d, 0x49, 0x54, 0x20, 0x31, 0x30,
+    0x00, 0x4c, 0x49, 0x4d, 0x49, 0x54, 0x20, 0x32, 0x30, 0x00,
+};
+
+void
+check_unit(const libmacro::dwarf_macro_unit &unit) {
+  ASSERT_EQ(2, unit.files.size());
+  EXPECT_EQ(1, unit.files[0].file);
+  EXPECT_EQ(size_t(-1), unit.files[0].parent);
+  EXPECT_EQ(2, unit.files[1].file);
+  EXPECT_EQ(2, unit.files[1].lineno);
+  EXPECT_EQ(0, unit.files[1].parent);
+
+  const auto *macros = unit.files[0].macros;
+  const char *in = "FOO BAR(1, 2) SQUARE(LIMIT)";
+  EXPECT_EQ("FOO BAR(1, 2) SQUARE(LIMIT)", libmacro::macro_expand(in, macros, 1));
+  EXPECT_EQ("1 BAR(1, 2) SQUARE(LIMIT)", libmacro::macro_expand(in, macros, 2));
+  EXPECT_EQ("1 BAR(1, 2) ((20) * (20))", libmacro::macro_expand(in, macros, 3));
+  EXPECT_EQ("FOO (1 + 2) ((20) * (20))", libmacro::macro_expand(in, macros, 5));
+  EXPECT_EQ("201710L", libmacro::macro_expand("__STDC_VERSION__", macros, 1));
+
+  // Lookups in the included file.
+  const auto *defs = unit.files[1].macros;
+  EXPECT_EQ("((2) * (2))", libmacro::macro_expand("SQUARE(2)", defs, 2));
+  EXPECT_EQ("LIMIT", libmacro::macro_expand("LIMIT", defs, 2));
+  EXPECT_EQ("10", libmacro::macro_expand("LIMIT", defs, 3));
+  EXPECT_EQ("LIMIT", libmacro::macro_expand("LIMIT", defs, 4));
+  EXPECT_EQ("20", libmacro::macro_expand("LIMIT", defs, 5));
+}
+
+TEST(dwarf, macinfo) {
+  libmacro::dwarf_sections sections{};
+  sections.macinfo = libmacro::dwarf_section{macinfo, sizeof(macinfo)};
+  libmacro::dwarf_macro_loader loader(sections);
+  check_unit(loader.load_macinfo(0));
+}
+
+TEST(dwarf, macro) {
+  libmacro::dwarf_sections sections{};
+  sections.macro = libmacro::dwarf_section{macro, sizeof(macro)};
+  sections.str = libmacro::dwarf_section{str, sizeof(str)};
+  libmacro::dwarf_macro_loader loader(sections);
+  check_unit(loader.load_macro(0));
+}
+
+// .debug_macro with entries, referencing a supplementary object file, and its
+// .debug_macro and .debug_str.
+const unsigned char macro_with_sup[] = {
+    0x05, 0x00, 0x00,                    // Header
+    0x03, 0x00, 0x01,                    // DW_MACRO_start_file 0 1
+    0x08, 0x01, 0x00, 0x00, 0x00, 0x00,  // DW_MACRO_define_sup 1 "SUP 1"
+    0x0a, 0x00, 0x00, 0x00, 0x00,        // DW_MACRO_import_sup 0
+    0x04, 0x00,
+};
+
+const unsigned char sup_macro[] = {
+    0x05, 0x00, 0x00,                    // Header
+    0x05, 0x03, 0x06, 0x00, 0x00, 0x00,  // DW_MACRO_define_strp 3 "IMP 2"
+    0x00,
+};
+
+const unsigned char sup_str[] = "SUP 1\0IMP 2";
+
+TEST(dwarf, supplementary) {
+  libmacro::dwarf_sections sections{};
+  sections.macro = libmacro::dwarf_section{macro_with_sup, sizeof(macro_with_sup)};
+  {
+    // The entries are skipped without the supplementary object file.
+    libmacro::dwarf_macro_loader loader(sections);
+    auto unit = loader.load_macro(0);
+    EXPECT_EQ("SUP IMP", libmacro::macro_expand("SUP IMP", unit.files[0].macros, 0));
+  }
+  sections.sup_macro = libmacro::dwarf_section{sup_macro, sizeof(sup_macro)};
+  sections.sup_str = libmacro::dwarf_section{sup_str, sizeof(sup_str)};
+  libmacro::dwarf_macro_loader loader(sections);
+  auto unit = loader.load_macro(0);
+  const auto *macros = unit.files[0].macros;
+  EXPECT_EQ("SUP IMP", libmacro::macro_expand("SUP IMP", macros, 1));
+  EXPECT_EQ("1 IMP", libmacro::macro_expand("SUP IMP", macros, 2));
+  EXPECT_EQ("1 2", libmacro::macro_expand("SUP IMP", macros, 4));
+}
+
+TEST(dwarf, truncated) {
+  libmacro::dwarf_sections sections{};
+  sections.macinfo = libmacro::dwarf_section{macinfo, sizeof(macinfo) - 1};
+  libmacro::dwarf_macro_loader loader(sections);
+  EXPECT_ANY_THROW(loader.load_macinfo(0));
+}
+
+}  // end namespace
@@ -0,0 +1,102 @@
+#include "libmacro-image.hh"
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <fstream>
+
+namespace {
+
+class included_table : public libmacro::included_macros {
+public:
+  const libmacro::macro_table *
+  get_macros() const override {
+    return &macros;
+  }
+
+  libmacro::macro_table macros;
+};
+
+class image_macros : public ::testing::Test {
+protected:
+  image_macros() {
+    header.macros.add_define(1, "LIMIT 10");
+    header.macros.add_define(2, "SQUARE(x) ((x) * (x))");
+    header.macros.add_undefine(3, "LIMIT");
+    header.macros.add_define(4, "LIMIT 20");
+    macros.add_define(1, "FOO 1");
+    macros.add_include(2, &header);
+    macros.add_define(3, "BAR(a,b) (a + b)");
+    macros.add_undefine(4, "FOO");
+    macros.add_define(5, "REC REC + FOO");
+    macros.add_define(6, "EMPTY() e");
+    libmacro::macro_image::write({&macros}, data);
+  }
+
+  included_table header;
+  libmacro::macro_table macros;
+  std::string data;
+};
+
+TEST_F(image_macros, find_define) {
+  libmacro::macro_image image(data.data(), data.size());
+  ASSERT_EQ(2, image.size());
+  ASSERT_EQ(nullptr, image.find_define(0, 1, "FOO"));
+  const auto *d = image.find_define(0, 3, "BAR");
+  ASSERT_EQ(nullptr, d);
+  d = image.find_define(0, 4, "BAR");
+  ASSERT_NE(nullptr, d);
+  ASSERT_EQ("BAR", d->name());
+  ASSERT_EQ(2, d->params().size());
+  ASSERT_EQ("(a + b)", d->repl());
+  ASSERT_EQ(d, image.find_define(0, 0, "BAR"));
+  ASSERT_EQ(nullptr, image.find_define(0, 0, "FOO"));
+  ASSERT_EQ(nullptr, image.find_define(0, 0, "NONE"));
+  ASSERT_EQ(nullptr, image.find_define(1, 4, "LIMIT"));
+  ASSERT_EQ("10", image.find_define(1, 3, "LIMIT")->repl());
+  ASSERT_EQ("20", image.find_define(0, 3, "LIMIT")->repl());
+
+  // Definitions are created from the parts in the image.
+  d = image.find_define(0, 0, "EMPTY");
+  ASSERT_NE(nullptr, d);
+  ASSERT_EQ(nullptr, d->text);
+  ASSERT_EQ(std::vector<std::string>{""}, d->params());
+  ASSERT_EQ("e", d->repl());
+  ASSERT_EQ("e", libmacro::macro_expand("EMPTY()", image, 0, 0));
+}
+
+TEST_F(image_macros, macro_expand) {
+  libmacro::macro_image image(data.data(), data.size());
+  const char *in = "FOO BAR(1, 2) SQUARE(LIMIT) REC EMPTY()";
+  for (unsigned int lineno = 0; lineno <= 7; ++lineno) {
+    ASSERT_EQ(libmacro::macro_expand(in, &macros, lineno),
+              libmacro::macro_expand(in, image, 0, lineno));
+  }
+  ASSERT_EQ("FOO (1 + 2) ((20) * (20)) REC + FOO e",
+            libmacro::macro_expand(in, image, 0, 0));
+}
+
+TEST_F(image_macros, expansion_sink) {
+  libmacro::macro_image image(data.data(), data.size());
+  std::string out = "x = ";
+  libmacro::string_sink sink(out);
+  libmacro::macro_expand("SQUARE(LIMIT)", image, 0, 5, sink);
+  ASSERT_EQ("x = ((20) * (20))", out);
+}
+
+TEST_F(image_macros, map) {
+  char path[] = "/tmp/libmacro-test-image-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+  auto image = libmacro::macro_image::map(path);
+  std::remove(path);
+  ASSERT_EQ("((20) * (20))", libmacro::macro_expand("SQUARE(LIMIT)", *image, 0, 5));
+}
+
+TEST_F(image_macros, invalid) {
+  ASSERT_ANY_THROW(libmacro::macro_image(data.data(), 16));
+  data[0] = 'X';
+  ASSERT_ANY_THROW(libmacro::macro_image(data.data(), data.size()));
+}
+
+}  // end namespace
@@ -1,5 +1,6 @@
 #include "libmacro.hh"
 #include "gtest/gtest.h"
+#include <thread>
 
 namespace {
 
@@ -257,4 +258,393 @@ TEST_F(simple_rec_macros1, simple_macro_expand) {
       out);
 }
 
+class included_table : public libmacro::included_macros {
+public:
+  const libmacro::macro_table *
+  get_macros() const override {
+    return &macros;
+  }
+
+  libmacro::macro_table macros;
+};
+
+class include_macros : public ::testing::Test {
+protected:
+  include_macros() {
+    header.macros.add_define(1, "A ha");
+    header.macros.add_define(2, "B hb");
+    macros.add_define(1, "A a");
+    macros.add_include(3, &header);
+    macros.add_define(4, "B b");
+    macros.add_undefine(5, "A");
+    macros.add_define(2, "C c");
+  }
+
+  included_table header;
+  libmacro::macro_table macros;
+};
+
+// Directives added out of line order.
+TEST_F(include_macros, out_of_order) {
+  included_table other;
+  other.macros.add_define(1, "D hd");
+  macros.add_define(6, "D d");
+  macros.add_include(5, &other);
+  ASSERT_EQ("d", libmacro::macro_expand("D", &macros, 0));
+  ASSERT_EQ("hd", libmacro::macro_expand("D", &macros, 6));
+  ASSERT_EQ("D", libmacro::macro_expand("D", &macros, 5));
+}
+
+TEST_F(include_macros, table_search) {
+  std::string out;
+  out = libmacro::macro_expand("A B C", &macros, 0);
+  ASSERT_EQ("A b c", out);
+  out = libmacro::macro_expand("A B C", &macros, 5);
+  ASSERT_EQ("ha b c", out);
+  out = libmacro::macro_expand("A B C", &macros, 4);
+  ASSERT_EQ("ha hb c", out);
+  out = libmacro::macro_expand("A B C", &macros, 3);
+  ASSERT_EQ("a B c", out);
+  out = libmacro::macro_expand("A B C", &macros, 2);
+  ASSERT_EQ("a B C", out);
+}
+
+TEST_F(include_macros, flatten) {
+  macros.flatten();
+  std::string out;
+  out = libmacro::macro_expand("A B C", &macros, 0);
+  ASSERT_EQ("A b c", out);
+  out = libmacro::macro_expand("A B C", &macros, 5);
+  ASSERT_EQ("ha b c", out);
+  out = libmacro::macro_expand("A B C", &macros, 4);
+  ASSERT_EQ("ha hb c", out);
+  out = libmacro::macro_expand("A B C", &macros, 3);
+  ASSERT_EQ("a B c", out);
+
+  // Modifying an included table invalidates the flattened directives.
+  header.macros.add_define(3, "C hc");
+  out = libmacro::macro_expand("A B C", &macros, 4);
+  ASSERT_EQ("ha hb hc", out);
+  macros.flatten();
+  out = libmacro::macro_expand("A B C", &macros, 4);
+  ASSERT_EQ("ha hb hc", out);
+}
+
+TEST_F(include_macros, lookup_stats) {
+  libmacro::expansion_context ctx;
+  std::string out;
+  ctx.expand("A + x * B - y / C", &macros, 0, out);
+  ASSERT_EQ("A + x * b - y / c", out);
+  // Identifiers from the replacement lists are looked up too.
+  ASSERT_EQ(4U, ctx.stats().filtered);
+  ASSERT_EQ(3U, ctx.stats().searched);
+
+  // The filter is recreated after modifications.
+  header.macros.add_define(3, "x hx");
+  ctx.expand("A + x * B - y / C", &macros, 0, out);
+  ASSERT_EQ("A + hx * b - y / c", out);
+  ASSERT_EQ(8U, ctx.stats().filtered);
+  ASSERT_EQ(7U, ctx.stats().searched);
+}
+
+TEST_F(include_macros, macro_scope) {
+  for (unsigned int lineno = 0; lineno <= 5; ++lineno) {
+    libmacro::macro_scope scope(&macros, lineno);
+    ASSERT_EQ(libmacro::macro_expand("A B C", &macros, lineno),
+              libmacro::macro_expand("A B C", scope));
+  }
+  libmacro::macro_scope scope(&macros, 4);
+  ASSERT_EQ(3U, scope.size());
+  ASSERT_EQ("ha", scope.find_define("A")->repl());
+}
+
+TEST_F(include_macros, equivalent_lines) {
+  libmacro::expansion_context ctx;
+  std::string out;
+  ctx.expand("A + x", &macros, 2, out);
+  ASSERT_EQ("a + x", out);
+  ASSERT_EQ(1U, ctx.dependencies().size());
+  auto r = macros.equivalent_lines(2, ctx.dependencies());
+  ASSERT_EQ(2U, r.begin);
+  ASSERT_EQ(4U, r.end);
+  ASSERT_TRUE(macros.equivalent(2, 3, ctx.dependencies()));
+  ASSERT_FALSE(macros.equivalent(2, 4, ctx.dependencies()));
+  ASSERT_EQ(out, libmacro::macro_expand("A + x", &macros, 3));
+
+  // Names, which are not defined anywhere, do not restrict the range.
+  ctx.expand("x + y", &macros, 2, out);
+  ASSERT_TRUE(ctx.dependencies().empty());
+  ASSERT_TRUE(macros.equivalent(2, 5, ctx.dependencies()));
+  ASSERT_FALSE(macros.equivalent(2, 0, ctx.dependencies()));
+}
+
+TEST_F(include_macros, expansion_cache) {
+  libmacro::expansion_cache cache(2);
+  ASSERT_EQ("a + x", cache.expand("A + x", &macros, 2));
+  ASSERT_EQ("a + x", cache.expand("A + x", &macros, 3));
+  ASSERT_EQ("ha + x", cache.expand("A + x", &macros, 4));
+  ASSERT_EQ(1U, cache.hits());
+  ASSERT_EQ(2U, cache.misses());
+
+  // The least recently used entry is evicted.
+  ASSERT_EQ("b", cache.expand("B", &macros, 5));
+  ASSERT_EQ(2U, cache.size());
+  ASSERT_EQ("a + x", cache.expand("A + x", &macros, 2));
+  ASSERT_EQ(4U, cache.misses());
+
+  // Modifications invalidate the entries.
+  header.macros.add_define(3, "x hx");
+  ASSERT_EQ("a + x", cache.expand("A + x", &macros, 2));
+  ASSERT_EQ("ha + hx", cache.expand("A + x", &macros, 4));
+  ASSERT_EQ(6U, cache.misses());
+}
+
+TEST(expansion_cache, destroyed_table) {
+  libmacro::expansion_cache cache(4);
+  std::unique_ptr<libmacro::macro_table> macros(new libmacro::macro_table);
+  macros->add_define(1, "A a");
+  ASSERT_EQ("a", cache.expand("A", macros.get(), 2));
+
+  // A table, which may be allocated at the same address, does not reuse the entries.
+  macros.reset();
+  macros.reset(new libmacro::macro_table);
+  macros->add_define(1, "A b");
+  ASSERT_EQ("b", cache.expand("A", macros.get(), 2));
+  ASSERT_EQ(0U, cache.hits());
+  ASSERT_EQ("b", cache.expand("A", macros.get(), 2));
+  ASSERT_EQ(1U, cache.hits());
+}
+
+TEST(scope_expansion, context_dependent) {
+  libmacro::macro_table macros;
+  macros.add_define(1, "X Y");
+  macros.add_define(2, "Y X+Z");
+  macros.add_define(3, "Z 1");
+  macros.add_define(4, "F(x) [x]");
+  macros.add_define(5, "G F");
+  macros.add_define(6, "LP (");
+  macros.add_define(7, "H F LP 1)");
+  libmacro::macro_scope scope(&macros, 0);
+  libmacro::expansion_context ctx;
+  std::string out;
+  for (int i = 0; i < 2; ++i) {
+    ctx.expand("X Y Z", scope, out);
+    ASSERT_EQ("X+1 Y+1 1", out);
+    ctx.expand("G(Z) G H", scope, out);
+    ASSERT_EQ("[1] F F ( 1)", out);
+    ctx.expand("F(X)", scope, out);
+    ASSERT_EQ("[X+1]", out);
+  }
+}
+
+TEST(table_builder, table_search) {
+  included_table header;
+  header.macros.add_define(1, "A ha");
+  header.macros.add_define(2, "B hb");
+  libmacro::macro_table_builder builder;
+  builder.add_undefine(5, "A");
+  builder.add_define(4, "B b");
+  builder.add_include(3, &header);
+  builder.add_define(1, "A a");
+  builder.add_define(2, "C c");
+  builder.add_define(2, "D d");
+  builder.add_undefine(2, "D");
+  auto macros = builder.build();
+  ASSERT_EQ(0U, builder.size());
+
+  ASSERT_EQ("A b c D", libmacro::macro_expand("A B C D", macros.get(), 0));
+  ASSERT_EQ("ha b c D", libmacro::macro_expand("A B C D", macros.get(), 5));
+  ASSERT_EQ("ha hb c D", libmacro::macro_expand("A B C D", macros.get(), 4));
+  ASSERT_EQ("a B c D", libmacro::macro_expand("A B C D", macros.get(), 3));
+  ASSERT_EQ("a B C D", libmacro::macro_expand("A B C D", macros.get(), 2));
+}
+
+TEST(table_builder, character_sequences) {
+  const char defs[] = "A a B b";
+  libmacro::macro_table_builder builder;
+  builder.add_define(2, defs + 4, 3);
+  builder.add_define(1, defs, 3);
+  builder.add_undefine(3, defs, 1);
+  auto macros = builder.build();
+  ASSERT_EQ("a b", libmacro::macro_expand("A B", macros.get(), 3));
+  ASSERT_EQ("A b", libmacro::macro_expand("A B", macros.get(), 0));
+
+  // The builder is reusable after building a table.
+  builder.add_define(1, defs + 4, 3);
+  auto other = builder.build();
+  ASSERT_EQ("A b", libmacro::macro_expand("A B", other.get(), 0));
+  ASSERT_EQ("a b", libmacro::macro_expand("A B", macros.get(), 3));
+}
+
+TEST(include_cycle, table_search) {
+  included_table a, b;
+  a.macros.add_define(1, "A a");
+  a.macros.add_include(2, &b);
+  b.macros.add_define(1, "B b");
+  b.macros.add_include(2, &a);
+  ASSERT_EQ("a b C", libmacro::macro_expand("A B C", &a.macros, 0));
+  ASSERT_EQ("a b C", libmacro::macro_expand("A B C", &b.macros, 0));
+}
+
+TEST(define, malformed_name) {
+  // A name, ending with ')' without a parameter list, is taken as is.
+  libmacro::macro_table macros;
+  macros.add_define(1, "X) 1");
+  macros.add_define(2, "Y 2");
+  const auto *d = macros.find_define(0, "X)");
+  ASSERT_NE(nullptr, d);
+  ASSERT_EQ("X)", d->name());
+  ASSERT_EQ(0, d->params().size());
+  ASSERT_EQ("1", d->repl());
+  ASSERT_EQ("X) 2", libmacro::macro_expand("X) Y", &macros, 0));
+}
+
+TEST(define_ref, table_search) {
+  // The definitions are parsed on first use, from the text of the caller.
+  const char text[] = "A(x) x + B B b";
+  libmacro::macro_table macros;
+  macros.add_define_ref(1, text, 10);
+  macros.add_define_ref(2, text + 11, 3);
+  ASSERT_EQ("1 + b", libmacro::macro_expand("A(1)", &macros, 3));
+  const auto *d = macros.find_define(3, "A");
+  ASSERT_EQ(text, d->text);
+  ASSERT_EQ("A", d->name());
+  ASSERT_EQ(1, d->params().size());
+}
+
+TEST_F(include_macros, string_ref) {
+  // Names and inputs may be slices of a larger buffer.
+  const char buf[] = "A B C";
+  libmacro::string_ref b(buf + 2, 1);
+  ASSERT_EQ(macros.find_define(4, "B"), macros.find_define(4, b));
+  ASSERT_EQ(nullptr, macros.find_define(4, libmacro::string_ref(buf, 2)));
+  ASSERT_EQ("ha hb", libmacro::macro_expand(libmacro::string_ref(buf, 3), &macros, 4));
+}
+
+TEST(memory_usage, parsed) {
+  libmacro::macro_table macros;
+  macros.add_define(1, "A(x) x + B");
+  macros.add_define(2, "B b");
+  macros.add_undefine(3, "B");
+  auto m = macros.memory_usage();
+  ASSERT_LE(16, m.text);
+  ASSERT_LT(0, m.directives);
+  ASSERT_LT(0, m.index);
+  ASSERT_EQ(0, m.parsed);
+  ASSERT_EQ("1 + b", libmacro::macro_expand("A(1)", &macros, 3));
+  m = macros.memory_usage();
+  ASSERT_LT(0, m.parsed);
+  ASSERT_EQ(m.directives + m.text + m.index + m.parsed, m.total());
+}
+
+TEST(memory_usage, filter) {
+  // Filters are not kept after modifications.
+  libmacro::macro_table a, b;
+  for (unsigned int i = 1; i <= 100; ++i) {
+    auto def = "M" + std::to_string(i) + " " + std::to_string(i);
+    a.add_define(i, def);
+    ASSERT_EQ(std::to_string(i), libmacro::macro_expand("M" + std::to_string(i), &a, 0));
+    b.add_define(i, def);
+  }
+  ASSERT_EQ("100", libmacro::macro_expand("M100", &b, 0));
+  ASSERT_EQ(b.memory_usage().index, a.memory_usage().index);
+}
+
+TEST(table_registry, shared_tables) {
+  auto header = []() {
+    std::unique_ptr<libmacro::macro_table> t(new libmacro::macro_table);
+    t->add_define(1, "A a");
+    t->add_define(2, "B b");
+    return t;
+  };
+  libmacro::macro_table_registry registry;
+  auto a = registry.intern(header());
+  auto b = registry.intern(header());
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(1, registry.size());
+
+  std::unique_ptr<libmacro::macro_table> other(new libmacro::macro_table);
+  other->add_define(1, "A b");
+  auto c = registry.intern(std::move(other));
+  ASSERT_NE(a, c);
+  ASSERT_EQ(2, registry.size());
+
+  // Included tables are kept alive by the including ones.
+  libmacro::macro_table macros;
+  macros.add_include(1, std::move(a));
+  b.reset();
+  ASSERT_EQ("a b", libmacro::macro_expand("A B", &macros, 2));
+  c.reset();
+  ASSERT_EQ(1, registry.size());
+}
+
+TEST_F(include_macros, concurrent_lookup) {
+  // After each modification of the included table, concurrent lookups race to replace
+  // the name filter of the including table.
+  for (int round = 0; round < 50; ++round) {
+    auto name = "R" + std::to_string(round);
+    header.macros.add_define(10, name + " r");
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([this, &name] {
+        for (int j = 0; j < 20; ++j) {
+          EXPECT_EQ("r", libmacro::macro_expand(name, &macros, 0));
+          EXPECT_NE(nullptr, macros.find_define(0, name));
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+  }
+}
+
+TEST_F(include_macros, expansion_context) {
+  libmacro::expansion_context ctx;
+  std::string out;
+  ctx.expand("A B C", &macros, 0, out);
+  ASSERT_EQ("A b c", out);
+  ctx.expand("A B C", &macros, 4, out);
+  ASSERT_EQ("ha hb c", out);
+  ctx.reset();
+  ctx.expand("A B C", &macros, 3, out);
+  ASSERT_EQ("a B c", out);
+}
+
+TEST_F(include_macros, expansion_sink) {
+  // Append to a string.
+  std::string out = "x: ";
+  libmacro::string_sink str(out);
+  libmacro::macro_expand("A B C", &macros, 4, str);
+  ASSERT_EQ("x: ha hb c", out);
+
+  // Store in a buffer, truncating the result.
+  char buf[5];
+  libmacro::buffer_sink small(buf, sizeof(buf));
+  libmacro::macro_expand("A B C", &macros, 4, small);
+  ASSERT_EQ(7, small.size());
+  ASSERT_TRUE(small.truncated());
+  ASSERT_EQ("ha hb", std::string(buf, sizeof(buf)));
+
+  // Pass the result in pieces to a custom sink.
+  struct piece_sink : libmacro::expansion_sink {
+    void
+    reserve(size_t size) override {
+      reserved = size;
+    }
+
+    void
+    write(const char *p, size_t size) override {
+      pieces.emplace_back(p, size);
+    }
+
+    size_t reserved = 0;
+    std::vector<std::string> pieces;
+  } pieces;
+  libmacro::expansion_context ctx;
+  ctx.expand("A B C", &macros, 4, pieces);
+  ASSERT_EQ(7, pieces.reserved);
+  std::vector<std::string> expected = {"ha", " ", "hb", " ", "c"};
+  ASSERT_EQ(expected, pieces.pieces);
+}
+
 }  // end namespace
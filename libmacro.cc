@@ -3,59 +3,260 @@
 #include "tokenize.hh"
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <unordered_set>
 
 namespace libmacro {
 
-std::locale detail::C_locale("C");
+namespace {
+
+// Identifier interning table. Lookups are lock-free and may run concurrently with each
+// other and with a single interning thread. Interning new names is serialized.
+class symbol_table {
+public:
+  symbol_table() : count_(0) {
+    slots_.emplace_back(new slot_array(1024));
+    current_.store(slots_.back().get(), std::memory_order_release);
+  }
+
+  detail::symbol
+  intern(detail::string_ref name) {
+    auto hash = detail::string_ref_hash()(name);
+    if (auto sym = find(current_.load(std::memory_order_acquire), name, hash))
+      return sym;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto *slots = current_.load(std::memory_order_relaxed);
+    if (auto sym = find(slots, name, hash))
+      return sym;
+    names_.push_back(entry{std::string(name.data(), name.size()), hash, 0});
+    names_.back().sym = names_.size();
+    // Keep the load factor below one half. Lookups in progress continue to use the old
+    // slot arrays, which are never released.
+    if (2 * (count_ + 1) > slots->mask + 1) {
+      slots_.emplace_back(new slot_array(2 * (slots->mask + 1)));
+      slots = slots_.back().get();
+      for (const auto &e : names_)
+        insert(slots, &e);
+      current_.store(slots, std::memory_order_release);
+    } else {
+      insert(slots, &names_.back());
+    }
+    ++count_;
+    return names_.back().sym;
+  }
+
+  detail::symbol
+  find(detail::string_ref name) const {
+    return find(
+        current_.load(std::memory_order_acquire), name, detail::string_ref_hash()(name));
+  }
+
+private:
+  struct entry {
+    std::string name;
+    size_t hash;
+    detail::symbol sym;
+  };
+
+  // Open addressing hash table of pointers to the interned names.
+  struct slot_array {
+    explicit slot_array(size_t n)
+        : mask(n - 1), slots(new std::atomic<const entry *>[n]) {
+      for (size_t i = 0; i < n; ++i)
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    size_t mask;
+    std::unique_ptr<std::atomic<const entry *>[]> slots;
+  };
+
+  static detail::symbol
+  find(const slot_array *a, detail::string_ref name, size_t hash) {
+    for (auto i = hash & a->mask;; i = (i + 1) & a->mask) {
+      const entry *e = a->slots[i].load(std::memory_order_acquire);
+      if (e == nullptr)
+        return 0;
+      if (e->hash == hash && detail::string_ref(e->name) == name)
+        return e->sym;
+    }
+  }
+
+  static void
+  insert(slot_array *a, const entry *e) {
+    auto i = e->hash & a->mask;
+    while (a->slots[i].load(std::memory_order_relaxed) != nullptr)
+      i = (i + 1) & a->mask;
+    a->slots[i].store(e, std::memory_order_release);
+  }
+
+  // Interned names. Elements of a deque are never relocated.
+  std::deque<entry> names_;
+  size_t count_;
+  std::vector<std::unique_ptr<slot_array>> slots_;
+  std::atomic<slot_array *> current_;
+  std::mutex mutex_;
+};
+
+symbol_table &
+symbols() {
+  static symbol_table table;
+  return table;
+}
+
+}  // end namespace
+
+detail::symbol
+detail::intern(string_ref name) {
+  return symbols().intern(name);
+}
+
+detail::symbol
+detail::find_symbol(string_ref name) {
+  return symbols().find(name);
+}
+
+namespace detail {
+// Replacement list of a macro definition, tokenized, verified and compiled once.
+struct macro_body {
+  // Operation of the substitution program of a function-like macro.
+  struct op {
+    enum kind { COPY, ARG, EXPAND, STRINGIFY, PASTE } kind;
+    // Whitespace before the first token of the result.
+    bool ws;
+    // Index of the first replacement token to COPY, or a parameter index.
+    size_t index;
+    // Number of replacement tokens to COPY.
+    size_t count;
+  };
+
+  // The tokens reference the replacement list text of the definition.
+  token_list tokens;
+  std::vector<op> program;
+};
+// Set of the names, defined in a table and in the included tables. The set is a Bloom
+// filter with two hashes and at least 16 bits per name, so a few other names are
+// reported as members too.
+struct name_filter {
+  name_filter(const macro_table *t, size_t count) : shift(64 - 8), tables(t) {
+    while ((uint64_t(1) << (64 - shift)) < 16 * count)
+      --shift;
+    bits.resize((uint64_t(1) << (64 - shift)) / 64);
+  }
+
+  void
+  insert(symbol sym) {
+    set(sym * UINT64_C(0x9e3779b97f4a7c15) >> shift);
+    set(sym * UINT64_C(0xc2b2ae3d27d4eb4f) >> shift);
+  }
+
+  bool
+  contains(symbol sym) const {
+    return test(sym * UINT64_C(0x9e3779b97f4a7c15) >> shift)
+           && test(sym * UINT64_C(0xc2b2ae3d27d4eb4f) >> shift);
+  }
+
+  void
+  set(uint64_t i) {
+    bits[i / 64] |= uint64_t(1) << (i % 64);
+  }
+
+  bool
+  test(uint64_t i) const {
+    return (bits[i / 64] >> (i % 64)) & 1;
+  }
+
+  // The bit set has 2^(64 - shift) bits, indexed by the high bits of the hashes.
+  unsigned int shift;
+  std::vector<uint64_t> bits;
+  macro_table::snapshot tables;
+};
+
+// Complete expansion of an object-like macro in a scope.
+struct object_expansion {
+  // The expansion does not depend on the tokens around the macro name.
+  bool context_free;
+  // Names, looked up during the expansion. The expansion is different, if any of them is
+  // not replaced, because it is being replaced already.
+  std::vector<symbol> deps;
+  token_list tokens;
+  arena text;
+};
+
+}  // end namespace detail
 
 namespace {
 
+// Get the name of the macro in a define string, without parsing the rest of it.
+detail::string_ref
+macro_name(detail::string_ref def) {
+  auto p = static_cast<const char *>(std::memchr(def.data(), ' ', def.size()));
+  if (p == nullptr)
+    return def;
+  if (p != def.begin() && p[-1] == ')') {
+    // Without the parameter list, the name extends to the space.
+    if (auto q = static_cast<const char *>(std::memchr(def.data(), '(', p - def.data())))
+      p = q;
+  }
+  return detail::string_ref(def.data(), p - def.data());
+}
+
 // Parse a macro define string, with syntax as specified by Sec 6.3.1.1 of the DWARF4
 // standard.
 // Note: an empty parameter list (|#define foo() bar|) is representedby a vector
 // containing one empty string. Macro with parameters (|#define foo bar|) is represented
 // with an empty vector.
 void
-parse_macro_def(const std::string &def,
+parse_macro_def(detail::string_ref def,
                 std::string &name,
                 std::vector<std::string> &params,
                 std::string &repl) {
   // First space (if any) separates macro name and parameters from the expansion text.
-  auto p = def.find(' ');
-  if (p == std::string::npos) {
+  auto p = static_cast<const char *>(std::memchr(def.data(), ' ', def.size()));
+  if (p == nullptr) {
     // No space, hence a simple macro name definition, without parameters and empty
     // replacement.
-    name = def;
+    name.assign(def.begin(), def.end());
     return;
   }
 
   // The replacement list follows the first space.
-  repl = def.substr(p + 1);
+  repl.assign(p + 1, def.end());
 
-  if (def[p - 1] == ')') {
-    // Parameter list is present.
-    p = def.find('(');
+  const char *lparen = nullptr;
+  if (p != def.begin() && p[-1] == ')')
+    lparen = static_cast<const char *>(std::memchr(def.data(), '(', p - def.data()));
+  if (lparen != nullptr) {
+    // Parameter list is present. Otherwise, a malformed name, ending with ')', is taken
+    // as is, as in macro_name.
+    p = lparen;
 
     // Split parameter names.
     auto start = p;
     do {
       ++start;
-      decltype(p) len = 0;
-      while (def[start + len] != ',' && def[start + len] != ')')
+      size_t len = 0;
+      while (start[len] != ',' && start[len] != ')')
         ++len;
-      auto begin = def.cbegin() + start, end = begin + len;
-      params.emplace_back(begin, end);
+      params.emplace_back(start, start + len);
       start += len;
-    } while (def[start] != ')');
+    } while (*start != ')');
   }
 
   // Separate the macro name.
-  assert(def[p] == ' ' || def[p] == '(');
-  name = def.substr(0, p);
+  assert(*p == ' ' || *p == '(');
+  name.assign(def.begin(), p);
 }
 
 using libmacro::detail::token;
 using libmacro::detail::token_list;
+using libmacro::detail::token_stream;
 using libmacro::detail::tokenize;
 
 // Verify compliance of a replacement token list with the C11
@@ -73,7 +274,7 @@ verify_replacement_tokens(const macro_table::define *def, const token_list &toke
     // function-like macro that uses the ellipsis notation in the parameters
     // (C11 6/10.3.1 #2).
     if (i->kind == token::ID && i->text == "__VA_ARGS__") {
-      if (def->params.size() == 0 || def->params.back() != "...")
+      if (def->params().size() == 0 || def->params().back() != "...")
         throw "__VA_ARGS__ can only appear in a variadic macro";
     } else if (i->kind == token::STRINGIFY) {
       // Each # preprocessing token in the replacement list for a function-like macro
@@ -82,69 +283,14 @@ verify_replacement_tokens(const macro_table::define *def, const token_list &toke
       auto next = i + 1;
       if (next == tokens.cend() || next->kind != token::ID
           || (next->text != "__VA_ARGS__"
-              && (std::find(def->params.cbegin(), def->params.cend(), next->text)
-                  == def->params.cend()))) {
+              && (std::find(def->params().cbegin(), def->params().cend(), next->text)
+                  == def->params().cend()))) {
         throw "# is not followed by a macro parameter";
       }
     }
   }
 }
 
-// Tokenize a macro definition.
-token_list
-tokenize(const macro_table::define *def) {
-  auto r = tokenize(def->repl.cbegin(), def->repl.cend(), def->params.size() != 0);
-  if (!def->checked) {
-    verify_replacement_tokens(def, r);
-    def->checked = true;
-  }
-  return r;
-}
-
-token_list::iterator
-gather_arguments(std::vector<std::string> &blacklist,
-                 token_list &tokens,
-                 token_list::iterator begin,
-                 bool variadic,
-                 size_t n,
-                 std::vector<token_list> &args) {
-  assert(begin != tokens.end() && begin->text == "(");
-  auto level = 0U;
-  auto next = begin;
-  while (next != tokens.end()) {
-    assert(blacklist.size() >= next->pop);
-    if (next->pop) {
-      blacklist.resize(blacklist.size() - next->pop);
-      next->pop = 0;
-    }
-    if (next->text == "(") {
-      // Increment nesting level.
-      ++level;
-      if (level == 1) {
-        begin = next;
-        ++begin;
-      }
-    } else if (next->text == ")") {
-      // Decrement nesting level. If it becomes zero, then we have collected the last
-      // argument. Return the token following the closing parenthesis.
-      --level;
-      if (level == 0) {
-        args.emplace_back(begin, next);
-        return next + 1;
-      }
-    } else if (next->text == ",") {
-      // Comma at nesting level one is argument separator.
-      if (level == 1 && (!variadic || args.size() + 1 < n)) {
-        args.emplace_back(begin, next);
-        begin = next + 1;
-      }
-    }
-    ++next;
-  }
-  // We failed to find the closing parenthesis.
-  throw "Missing closing parenthesis";
-}
-
 // Convert a token to a string, as for stringification.
 void
 stringify(const token &t, std::string &out) {
@@ -160,11 +306,11 @@ stringify(const token &t, std::string &out) {
           out += ch;
       }
     } else {
-      out += t.text;
+      out.append(t.text.data(), t.text.size());
     }
     break;
   case token::ID:
-    out += t.text;
+    out.append(t.text.data(), t.text.size());
     break;
   case token::STRINGIFY:
     out += "#";
@@ -177,10 +323,11 @@ stringify(const token &t, std::string &out) {
   }
 }
 
-// Convert a list of tokens to a string constant.
-std::string
-stringify(const token_list &tokens) {
-  std::string res;
+// Convert a list of tokens to a string constant, stored in an arena. The string is built
+// in a scratch buffer.
+string_ref
+stringify(const token_list &tokens, std::string &res, detail::arena &text) {
+  res.clear();
   res += '"';
   auto t = tokens.cbegin();
   // Output the first token without any leading whitespace.
@@ -197,107 +344,63 @@ stringify(const token_list &tokens) {
     ++t;
   }
   res += '"';
-  return res;
-}
-
-std::vector<std::string>::const_iterator
-find(const std::vector<std::string> &params, const std::string &name) {
-  if (name == "__VA_ARGS__")
-    // Correctness is ensured by the verification at tokenize time.
-    return params.cbegin() + (params.size() - 1);
-  else
-    return std::find(params.cbegin(), params.cend(), name);
-}
-
-// Perform parameter substitution (including inserting placemarkers) and stringification.
-void macro_expand(std::vector<std::string> &,
-                  const macro_table *,
-                  unsigned int,
-                  token_list &);
-void
-substitute_parameters(std::vector<std::string> &blacklist,
-                      const std::vector<token_list> &args,
-                      const std::vector<std::string> &params,
-                      const macro_table *macros,
-                      unsigned int lineno,
-                      token_list &repl) {
-  bool ws;
-  std::vector<std::string>::const_iterator p;
-  token_list::iterator prev, next;
-  auto curr = repl.begin();
-  while (curr != repl.end()) {
-    if (curr->kind == token::ID) {
-      // Check if the identifier is a macro parameter.
-      if ((p = find(params, curr->text)) != params.cend()) {
-        // Get a read-only reference to the argument tokens list.
-        const auto &arg = args[p - params.cbegin()];
-        // If a parameter is preceded by a # or ## or followed by ##, then macro
-        // replacement does not take place before its substitution (C11, 6.10.3.1).
-        next = curr + 1;
-        if (curr == repl.begin())
-          prev = curr;
-        else
-          prev = curr - 1;
-        if (prev->kind == token::PASTE
-            || (next != repl.end() && next->kind == token::PASTE)) {
-          if (arg.empty()) {
-            // If the argument token list consists of no preprocessing tokens and the
-            // parameter name is preceded or followed by a token paste operator, replace
-            // the name with a placemarker token (C11, 6.10.3.3 #2).
-            curr->kind = token::PLACEMARKER;
-            curr->text.clear();
-            ++curr;
-          } else {
-            // Replace the argument as is.
-            ws = curr->ws;
-            prev = repl.insert(curr, arg.cbegin(), arg.cend());
-            prev->ws = ws;
-            curr = repl.erase(prev + arg.size());
-          }
-        } else {
-          // Make a copy of the argument and completely macro-replace it.
-          auto cpy = arg;
-          auto depth = blacklist.size();
-          macro_expand(blacklist, macros, lineno, cpy);
-          assert(blacklist.size() >= depth);
-          blacklist.resize(depth);
-          if (cpy.empty()) {
-            next = curr + 1;
-            if (next != repl.end())
-              next->ws = curr->ws;
-            curr = repl.erase(curr);
-          } else {
-            ws = curr->ws;
-            prev = repl.insert(curr,
-                               std::make_move_iterator(cpy.begin()),
-                               std::make_move_iterator(cpy.end()));
-            prev->ws = ws;
-            curr = repl.erase(prev + cpy.size());
-          }
-        }
-      } else {
-        // Not a parameter.
-        ++curr;
-      }
-    } else if (curr->kind == token::STRINGIFY) {
-      // The stringify operator is followed by a parameter name token.
-      next = curr + 1;
-      assert(next != repl.end() && next->kind == token::ID);
-      p = find(params, next->text);
-      assert(p != params.end());
-      const auto &arg = args[p - params.cbegin()];
-      curr->kind = token::OTHER;
-      curr->text = stringify(arg);
-      curr = repl.erase(next);
-    } else {
-      ++curr;
-    }
+  return detail::copy_text(text, res.cbegin(), res.cend());
+}
+
+// Concatenate two preprocessing tokens (C11 6.10.3.3 #3). Placemarker tokens are dropped
+// when concatenated with any other token. The text of the resulting token is stored in
+// an arena.
+void
+paste_token(detail::arena &text, token &lhs, const token &rhs) {
+  if (rhs.kind == token::PLACEMARKER)
+    return;
+  if (lhs.kind == token::PLACEMARKER) {
+    lhs = rhs;
+    return;
+  }
+  // When concatenating tokens, ignore inner whitespace.
+  auto size = lhs.text.size() + rhs.text.size();
+  auto p = static_cast<char *>(text.allocate(size, 1));
+  std::memcpy(p, lhs.text.data(), lhs.text.size());
+  std::memcpy(p + lhs.text.size(), rhs.text.data(), rhs.text.size());
+  lhs.text = string_ref(p, size);
+  // Check we have obtained a valid preprocessing token.
+  size_t ws;
+  auto end = scan_pp_token(lhs.text.begin(), lhs.text.end(), lhs.kind, ws);
+  if (end != lhs.text.end())
+    throw "Token paste results in invalid preprocessing token";
+  // The resulting token is available for a further macro replacement
+  // (C11 6.10.3.3 #3), but is never # or ## operator.
+  if (lhs.kind != token::ID)
+    lhs.kind = token::OTHER;
+  lhs.sym = lhs.kind == token::ID ? detail::find_symbol(lhs.text) : 0;
+  lhs.noexpand = false;
+  lhs.pop += rhs.pop;
+}
+
+// Append a sequence of tokens to a replacement list, setting the whitespace flag of the
+// first one. If requested, the first token is pasted to the last token of the list.
+template<typename It>
+void
+append_tokens(
+    detail::arena &text, token_list &repl, It begin, It end, bool ws, bool &paste) {
+  if (begin == end)
+    return;
+  token t(*begin);
+  t.ws = ws;
+  if (paste) {
+    paste_token(text, repl.back(), t);
+    paste = false;
+  } else {
+    repl.push_back(t);
   }
+  repl.insert(repl.end(), ++begin, end);
 }
 
-// Perform token pasting.
+// Perform token pasting around the ## operators, which are not part of the replacement
+// list itself, but come from the expansion of object-like macros in the arguments.
 void
-paste_tokens(token_list &repl) {
+paste_tokens(detail::arena &text, token_list &repl) {
   auto prev = repl.end();
   auto curr = repl.begin();
   while (curr != repl.end()) {
@@ -318,19 +421,7 @@ paste_tokens(token_list &repl) {
         ++next;
         curr = repl.erase(curr, next);
       } else {
-        // When concatenating tokens, ignore inner whitespace.
-        prev->text.append(next->text);
-        // Check we have obtained a valid preprocessing token.
-        size_t ws;
-        auto end = scan_pp_token(prev->text.cbegin(), prev->text.cend(), prev->kind, ws);
-        if (end != prev->text.cend())
-          throw "Token paste results in invalid preprocessing token";
-        // The resulting token is available for a further macro replacement
-        // (C11 6.10.3.3 #3), but is never # or ## operator.
-        if (prev->kind != token::ID)
-          prev->kind = token::OTHER;
-        prev->noexpand = false;
-        prev->pop += next->pop;
+        paste_token(text, *prev, *next);
         ++next;
         curr = repl.erase(curr, next);
       }
@@ -341,290 +432,1636 @@ paste_tokens(token_list &repl) {
   }
 }
 
+// Check if a token list contains ## operators.
+template<typename Container>
+bool
+has_paste(const Container &tokens) {
+  return std::any_of(tokens.cbegin(), tokens.cend(), [](const token &t) {
+    return t.kind == token::PASTE;
+  });
+}
+
+// Compile the replacement list of a function-like macro into a substitution program.
 void
-macro_expand(std::vector<std::string> &blacklist,
-             const macro_table *macros,
-             unsigned int lineno,
-             token_list &tokens) {
-  token_list repl;
-  const macro_table::define *def;
-  token_list::iterator prev, curr, next;
-  curr = tokens.begin();
-  while (curr != tokens.end()) {
-    // Pop names from the blacklist if the current token ends the range where their
-    // replacement is forbiden.
-    assert(blacklist.size() >= curr->pop);
-    if (curr->pop) {
-      blacklist.resize(blacklist.size() - curr->pop);
-      curr->pop = 0;
-    }
+compile_function_like(const macro_table::define *def, detail::macro_body &body) {
+  typedef detail::macro_body::op op;
+  const auto &tokens = body.tokens;
+  auto &program = body.program;
 
-    // Not an identifier, no replacement.
-    if (curr->kind != token::ID
-        // Expansion forbidden, because at one point found in blacklist.
-        || curr->noexpand) {
-      ++curr;
-      continue;
+  // Get the parameter symbols. The identifier __VA_ARGS__ stands for the last
+  // parameter. Correctness is ensured by the verification of the replacement list.
+  std::vector<detail::symbol> params;
+  for (const auto &p : def->params())
+    params.push_back(detail::intern(p == "..." ? "__VA_ARGS__" : p));
+  std::vector<detail::symbol>::const_iterator p;
+
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    const auto &t = tokens[i];
+    if (t.kind == token::ID
+        && (p = std::find(params.cbegin(), params.cend(), t.sym)) != params.cend()) {
+      // If a parameter is preceded by a # or ## or followed by ##, then macro
+      // replacement does not take place before its substitution (C11, 6.10.3.1).
+      bool raw = (i > 0 && tokens[i - 1].kind == token::PASTE)
+                 || (i + 1 < tokens.size() && tokens[i + 1].kind == token::PASTE);
+      program.push_back(
+          {raw ? op::ARG : op::EXPAND, t.ws, size_t(p - params.cbegin()), 0});
+    } else if (t.kind == token::STRINGIFY) {
+      // The stringify operator is followed by a parameter name token.
+      ++i;
+      assert(i < tokens.size() && tokens[i].kind == token::ID);
+      p = std::find(params.cbegin(), params.cend(), tokens[i].sym);
+      assert(p != params.cend());
+      program.push_back({op::STRINGIFY, t.ws, size_t(p - params.cbegin()), 0});
+    } else if (t.kind == token::PASTE) {
+      // Consecutive ## operators are treated as a single one.
+      if (program.back().kind != op::PASTE)
+        program.push_back({op::PASTE, t.ws, 0, 0});
+    } else if (!program.empty() && program.back().kind == op::COPY
+               && program.back().index + program.back().count == i) {
+      // Extend the current run of tokens, copied as is.
+      ++program.back().count;
+    } else {
+      program.push_back({op::COPY, t.ws, i, 1});
     }
+  }
+}
 
-    // If found an identifier, check the blacklist.
-    if (std::find(blacklist.cbegin(), blacklist.cend(), curr->text) != blacklist.cend()) {
-      // Do not replace this token anymore, even if it is re-examined in a context where
-      // it is not blacklisted (C11, 16.3.4 #2).
-      curr->noexpand = true;
-      ++curr;
-      continue;
+// Get the compiled replacement list of a macro definition. Concurrent callers may
+// compile the same definition, only one of the results is kept.
+const detail::macro_body &
+get_body(const macro_table::define *def) {
+  if (auto *body = def->body.load(std::memory_order_acquire))
+    return *body;
+  std::unique_ptr<detail::macro_body> body(new detail::macro_body);
+  const auto &repl = def->repl();
+  tokenize(repl.data(),
+           repl.data() + repl.size(),
+           def->params().size() != 0,
+           true,
+           body->tokens);
+  verify_replacement_tokens(def, body->tokens);
+  if (def->params().size() != 0)
+    compile_function_like(def, *body);
+  detail::macro_body *expected = nullptr;
+  if (def->body.compare_exchange_strong(expected, body.get(), std::memory_order_acq_rel))
+    return *body.release();
+  return *expected;
+}
+
+}  // end namespace
+
+namespace detail {
+
+// The names of the macros, whose replacement is in progress, and which are not replaced
+// again ("blacklist"). Names are removed in the reverse order of their addition.
+// Set of symbols, as an open addressing hash table. Its size depends on the number of
+// elements, not on the values of the symbols.
+class symbol_set {
+public:
+  symbol_set() : slots_(16, 0), count_(0) {}
+
+  bool
+  contains(symbol sym) const {
+    for (auto i = slot(sym);; i = next(i)) {
+      if (slots_[i] == 0)
+        return false;
+      if (slots_[i] == sym)
+        return true;
     }
+  }
 
-    // If not blacklisted, check if there is such a macro definition.
-    if ((def = macros->find_define(lineno, curr->text)) == nullptr) {
-      ++curr;
-      continue;
+  // Insert a symbol, returning false, if it is already present.
+  bool
+  insert(symbol sym) {
+    assert(sym != 0);
+    if (2 * (count_ + 1) > slots_.size())
+      grow();
+    auto i = slot(sym);
+    for (; slots_[i] != 0; i = next(i)) {
+      if (slots_[i] == sym)
+        return false;
     }
+    slots_[i] = sym;
+    ++count_;
+    return true;
+  }
 
-    // Found a macro to expand.
-    if (def->params.size() == 0) {
-      // Object-like macro.
-      repl = tokenize(def);
-      if (repl.empty()) {
-        next = curr + 1;
-        if (next != tokens.end())
-          next->ws = curr->ws;
-        curr = tokens.erase(curr);
-      } else {
-        blacklist.push_back(def->name);
-        repl.front().ws = curr->ws;
-        next = curr + 1;
-        if (next != tokens.end())
-          ++next->pop;
-        prev = tokens.insert(curr,
-                             std::make_move_iterator(repl.begin()),
-                             std::make_move_iterator(repl.end()));
-        tokens.erase(prev + repl.size());
-        curr = prev;
+  void
+  erase(symbol sym) {
+    auto i = slot(sym);
+    for (; slots_[i] != sym; i = next(i)) {
+      if (slots_[i] == 0)
+        return;
+    }
+    // Shift back the following symbols of the cluster, which may not be found otherwise.
+    for (auto j = next(i); slots_[j] != 0; j = next(j)) {
+      auto k = slot(slots_[j]);
+      if (i < j ? (k <= i || k > j) : (k <= i && k > j)) {
+        slots_[i] = slots_[j];
+        i = j;
       }
-    } else {
-      // Function-like macro. If the next token is an opening parenthesis, expand the
-      // macro, otherwise skip the name.
-      next = curr + 1;
-      if (next != tokens.end() && next->kind == token::OTHER && next->text == "(") {
-        // Gather arguments.
-        bool variadic = def->params.size() && def->params.back() == "...";
-        std::vector<token_list> args;
-        next = gather_arguments(
-            blacklist, tokens, next, variadic, def->params.size(), args);
-        // Check the number of actual arguments matches the number of macro parameters.
-        if (variadic) {
-          // A variadic macro should have an argument for every named parameter.
-          if (args.size() < def->params.size() - 1)
-            throw "Insufficient number of arguments";
-          // "Pad" the arguments list with an empty one.
-          args.resize(def->params.size());
-        } else {
-          if (args.size() == def->params.size()) {
-            // A function-like macro with empty parameter list must be given a single
-            // empty argument.
-            if (def->params.size() == 1 && def->params[0].empty() && !args[0].empty()) {
-              throw "Too many macro arguments";
-            }
-          } else if (args.size() > def->params.size()) {
-            throw "Too many macro arguments";
-          } else {
-            throw "Insufficient number of arguments";
-          }
-        }
-        // Perform parameter substitution and stringification.
-        repl = tokenize(def);
-        substitute_parameters(blacklist, args, def->params, macros, lineno, repl);
-        // Paste tokens.
-        paste_tokens(repl);
-        // Remove placemarkers.
-        repl.erase(
-            std::remove_if(repl.begin(),
-                           repl.end(),
-                           [](const token &t) { return t.kind == token::PLACEMARKER; }),
-            repl.end());
-        // Rescan/repeat expand.
-        if (repl.empty()) {
-          if (next != tokens.end())
-            next->ws = curr->ws;
-          curr = tokens.erase(curr, next);
-        } else {
-          blacklist.push_back(def->name);
-          if (next != tokens.end())
-            ++next->pop;
-          repl.front().ws = curr->ws;
-          curr = tokens.insert(tokens.erase(curr, next),
-                               std::make_move_iterator(repl.begin()),
-                               std::make_move_iterator(repl.end()));
-        }
-      } else {
-        ++curr;
+    }
+    slots_[i] = 0;
+    --count_;
+  }
+
+  void
+  clear() {
+    std::fill(slots_.begin(), slots_.end(), 0);
+    count_ = 0;
+  }
+
+private:
+  size_t
+  slot(symbol sym) const {
+    return (sym * UINT64_C(0x9e3779b97f4a7c15) >> 32) & (slots_.size() - 1);
+  }
+
+  size_t
+  next(size_t i) const {
+    return (i + 1) & (slots_.size() - 1);
+  }
+
+  void
+  grow() {
+    std::vector<symbol> old(2 * slots_.size(), 0);
+    old.swap(slots_);
+    for (auto sym : old) {
+      if (sym != 0) {
+        auto i = slot(sym);
+        while (slots_[i] != 0)
+          i = next(i);
+        slots_[i] = sym;
       }
     }
   }
-}
 
-// Helper template for exception safe save/restore of a value.
-template<typename T>
-class safe_save_restore {
+  // Zero marks an empty slot. The number of slots is a power of two.
+  std::vector<symbol> slots_;
+  size_t count_;
+};
+
+class active_macros {
 public:
-  safe_save_restore(T &loc, T val) : location_(loc) {
-    saved_value_ = location_;
-    location_ = val;
+  bool
+  contains(symbol sym) const {
+    return active_.contains(sym);
+  }
+
+  size_t
+  size() const {
+    return stack_.size();
+  }
+
+  void
+  push_back(symbol sym) {
+    assert(!contains(sym));
+    active_.insert(sym);
+    stack_.push_back(sym);
   }
 
-  ~safe_save_restore() { location_ = saved_value_; }
+  void
+  resize(size_t n) {
+    assert(n <= stack_.size());
+    while (stack_.size() > n) {
+      active_.erase(stack_.back());
+      stack_.pop_back();
+    }
+  }
 
-protected:
-  T saved_value_;
-  T &location_;
+private:
+  symbol_set active_;
+  std::vector<symbol> stack_;
 };
 
-}  // end namespace
+// Stack of reusable scratch objects, which are borrowed and returned in LIFO order.
+template<typename T>
+class scratch_stack {
+public:
+  scratch_stack() : used_(0) {}
 
-macro_table::~macro_table() {
-  for (auto &e : table_)
-    e.destroy();
-}
+  T &
+  push() {
+    if (used_ == items_.size())
+      items_.emplace_back(new T);
+    return *items_[used_++];
+  }
 
-macro_table::entry *
-macro_table::make_entry(unsigned int lineno) {
-  // Shortcut for the common case of entries made in increasing line number order.
-  if (table_.size() == 0 || table_.back().lineno <= lineno) {
-    table_.resize(table_.size() + 1);
-    return &table_.back();
+  void
+  pop() {
+    assert(used_ > 0);
+    --used_;
   }
 
-  // Slow path
-  table_.resize(table_.size() + 1);
-  auto i = table_.size() - 1;
-  while (i > 0 && table_[i - 1].lineno > lineno) {
-    std::swap(table_[i], table_[i - 1]);
-    --i;
+  // Iterate over all the objects, including the ones not in use.
+  typename std::vector<std::unique_ptr<T>>::iterator
+  begin() {
+    return items_.begin();
   }
 
-  return &table_[i];
-}
+  typename std::vector<std::unique_ptr<T>>::iterator
+  end() {
+    return items_.end();
+  }
 
-void
-macro_table::add_define(unsigned int lineno, const std::string &def) {
-  entry *e = make_entry(lineno);
-  e->kind = entry::DEFINE;
-  e->lineno = lineno;
-  e->def = new define;
-  e->def->checked = false;
-  parse_macro_def(def, e->def->name, e->def->params, e->def->repl);
-}
+private:
+  std::vector<std::unique_ptr<T>> items_;
+  size_t used_;
+};
 
-void
-macro_table::add_undefine(unsigned int lineno, const std::string &name) {
-  entry *e = make_entry(lineno);
-  e->kind = entry::UNDEFINE;
-  e->lineno = lineno;
-  e->undef = new undefine;
-  e->undef->name = name;
-}
+// A scratch object, borrowed from a stack for the duration of a scope.
+template<typename T>
+class scratch {
+public:
+  explicit scratch(scratch_stack<T> &stack) : stack_(stack), item_(stack.push()) {}
+  scratch(const scratch &) = delete;
+  scratch &operator=(const scratch &) = delete;
 
-void
-macro_table::add_include(unsigned int lineno, const included_macros *nested) {
-  entry *e = make_entry(lineno);
-  e->kind = entry::INCLUDE;
-  e->lineno = lineno;
-  e->include = nested;
-}
+  ~scratch() { stack_.pop(); }
 
-macro_table::entry::entry() : kind(INVALID), lineno(0), def(nullptr) {}
+  T &operator*() const { return item_; }
 
-void
-macro_table::entry::destroy() {
-  switch (kind) {
-  case DEFINE:
-    delete def;
-    break;
-  case UNDEFINE:
-    delete undef;
-    break;
-  default:
-  case INVALID:
-    break;
+  T *operator->() const { return &item_; }
+
+private:
+  scratch_stack<T> &stack_;
+  T &item_;
+};
+
+// Arguments of a function-like macro invocation. Token lists are kept for reuse by
+// subsequent invocations.
+class argument_list {
+public:
+  argument_list() : size_(0) {}
+
+  size_t
+  size() const {
+    return size_;
   }
-}
 
-const macro_table::define *
-macro_table::find_define(unsigned int lineno, const std::string &name) const {
-  if (in_use_ || table_.size() == 0)
-    return nullptr;
+  const token_list &operator[](size_t i) const { return lists_[i]; }
 
-  // Protect from cycles in the incuded files.
-  safe_save_restore<bool> in_use(in_use_, true);
-
-  // Find the source location to start the search from.
-  size_t idx;
-  if (lineno > 0) {
-    // Binary search in the macros table for the first line number, greater than or equal
-    // to the given one.
-    size_t lower = 0, upper = table_.size();
-    while (lower < upper) {
-      size_t m = (lower + upper) / 2;
-      if (table_[m].lineno < lineno)
-        lower = m + 1;
-      else
-        upper = m;
+  template<typename It>
+  void
+  push_back(It begin, It end) {
+    if (size_ == lists_.size())
+      lists_.emplace_back();
+    lists_[size_++].assign(begin, end);
+  }
+
+  // Add empty arguments, up to the given number.
+  void
+  pad(size_t n) {
+    while (size_ < n) {
+      if (size_ == lists_.size())
+        lists_.emplace_back();
+      lists_[size_++].clear();
     }
+  }
 
-    idx = lower;
-  } else {
-    // 0 means start from the end of the table.
-    idx = table_.size();
-  }
-
-  // Examine the macro entries from the next smaller index downwards.
-  assert(idx == table_.size() || table_[idx].lineno >= lineno);
-  while (idx-- > 0) {
-    switch (table_[idx].kind) {
-    case entry::DEFINE:
-      // Found a macro definition for the name
-      if (table_[idx].def->name == name)
-        return table_[idx].def;
+  void
+  clear() {
+    size_ = 0;
+  }
+
+private:
+  std::vector<token_list> lists_;
+  size_t size_;
+};
+
+// Scratch storage for the function-like macro invocations at one level of the macro
+// replacement recursion.
+struct invocation {
+  argument_list args;
+  // Macro-replaced arguments, computed at most once per invocation.
+  std::vector<token_stream> expanded;
+  std::vector<bool> done;
+  // Result of the parameter substitution.
+  token_list repl;
+};
+
+// Macro expansion engine. The memory, allocated during an expansion, is kept for reuse
+// by the subsequent expansions.
+class expander {
+public:
+  expander()
+      : macros_(nullptr),
+        lineno_(0),
+        scope_(nullptr),
+        source_(nullptr),
+        expanding_object_like_(false),
+        stats_{0, 0} {}
+
+  // Set the source of the macro definitions for the subsequent expansions.
+  void use(const macro_table *, unsigned int);
+  void use(const macro_scope &);
+  void use(const definition_source &);
+
+  // Macro expand the input and pass the result to OUT, either a string to replace or an
+  // expansion sink.
+  template<typename Output>
+  void expand(string_ref, Output &);
+  void expand_object_like(const macro_scope &, symbol, object_expansion &);
+  void reset();
+
+  const lookup_stats &
+  stats() const {
+    return stats_;
+  }
+
+  const std::vector<symbol> &
+  dependencies() const {
+    return deps_;
+  }
+
+private:
+  token_stream::iterator gather_arguments(token_stream &,
+                                          token_stream::iterator,
+                                          bool,
+                                          size_t,
+                                          argument_list &);
+  void substitute_parameters(invocation &, const macro_body &);
+  void add_dependency(symbol);
+  const macro_table::define *find_define(token &);
+  void macro_expand(token_stream &);
+  void emit(const token_stream &, std::string &);
+  void emit(const token_stream &, expansion_sink &);
+
+  // Storage for token list nodes and for the text of pasted and stringified tokens.
+  arena arena_;
+  active_macros blacklist_;
+  scratch_stack<invocation> invocations_;
+  // Buffer for stringification.
+  std::string buffer_;
+  // Macro definitions, either from a table at a line, from a scope, or from another
+  // source.
+  const macro_table *macros_;
+  unsigned int lineno_;
+  const macro_scope *scope_;
+  const definition_source *source_;
+  // Whether creating a complete expansion of an object-like macro.
+  bool expanding_object_like_;
+  lookup_stats stats_;
+  // Names, looked up by the last expansion, without duplicates.
+  std::vector<symbol> deps_;
+  symbol_set is_dep_;
+};
+
+token_stream::iterator
+expander::gather_arguments(token_stream &tokens,
+                           token_stream::iterator begin,
+                           bool variadic,
+                           size_t n,
+                           argument_list &args) {
+  assert(begin != tokens.end() && begin->text == "(");
+  auto level = 0U;
+  auto next = begin;
+  while (next != tokens.end()) {
+    assert(blacklist_.size() >= next->pop);
+    if (next->pop) {
+      blacklist_.resize(blacklist_.size() - next->pop);
+      next->pop = 0;
+    }
+    if (next->text == "(") {
+      // Increment nesting level.
+      ++level;
+      if (level == 1) {
+        begin = next;
+        ++begin;
+      }
+    } else if (next->text == ")") {
+      // Decrement nesting level. If it becomes zero, then we have collected the last
+      // argument. Return the token following the closing parenthesis.
+      --level;
+      if (level == 0) {
+        args.push_back(begin, next);
+        return ++next;
+      }
+    } else if (next->text == ",") {
+      // Comma at nesting level one is argument separator.
+      if (level == 1 && (!variadic || args.size() + 1 < n)) {
+        args.push_back(begin, next);
+        begin = std::next(next);
+      }
+    }
+    ++next;
+  }
+  // We failed to find the closing parenthesis.
+  throw "Missing closing parenthesis";
+}
+
+// Perform parameter substitution (including inserting placemarkers), stringification and
+// token pasting, by running the substitution program of a function-like macro.
+void
+expander::substitute_parameters(invocation &inv, const macro_body &body) {
+  typedef macro_body::op op;
+  const auto &args = inv.args;
+  auto &repl = inv.repl;
+  bool paste = false, placemarkers = false, stray = false, ws = false, ws_pending = false;
+  repl.clear();
+  inv.done.assign(args.size(), false);
+  while (inv.expanded.size() < args.size())
+    inv.expanded.emplace_back(token_stream::allocator_type(arena_));
+  for (const auto &o : body.program) {
+    // An argument, which is macro-replaced to no tokens, passes its preceding whitespace
+    // to the next token.
+    if (ws_pending)
+      ws_pending = false;
+    else
+      ws = o.ws;
+    switch (o.kind) {
+    case op::COPY: {
+      auto begin = body.tokens.cbegin() + o.index;
+      append_tokens(arena_, repl, begin, begin + o.count, ws, paste);
       break;
-    case entry::UNDEFINE:
-      // Found an undefine directive; terminate search.
-      if (table_[idx].def->name == name)
-        return nullptr;
+    }
+    case op::ARG: {
+      const auto &arg = args[o.index];
+      if (arg.empty()) {
+        // If the argument token list consists of no preprocessing tokens and the
+        // parameter name is preceded or followed by a token paste operator, replace
+        // the name with a placemarker token (C11, 6.10.3.3 #2).
+        token t(token::PLACEMARKER, ws);
+        append_tokens(arena_, repl, &t, &t + 1, ws, paste);
+        placemarkers = true;
+      } else {
+        // Replace the argument as is.
+        append_tokens(arena_, repl, arg.cbegin(), arg.cend(), ws, paste);
+        stray = stray || has_paste(arg);
+      }
       break;
-    case entry::INCLUDE:
-      // Search among the directives in the included file
-      if (const define *d = table_[idx].include->get_macros()->find_define(0, name))
-        return d;
+    }
+    case op::EXPAND: {
+      // Completely macro-replace a copy of the argument, once per invocation
+      // (C11 6.10.3.1 #1).
+      auto &cpy = inv.expanded[o.index];
+      if (!inv.done[o.index]) {
+        cpy.assign(args[o.index].cbegin(), args[o.index].cend());
+        auto depth = blacklist_.size();
+        macro_expand(cpy);
+        assert(blacklist_.size() >= depth);
+        blacklist_.resize(depth);
+        stray = stray || has_paste(cpy);
+        inv.done[o.index] = true;
+      }
+      if (cpy.empty())
+        ws_pending = true;
+      else
+        append_tokens(arena_, repl, cpy.cbegin(), cpy.cend(), ws, paste);
       break;
-    default:
+    }
+    case op::STRINGIFY: {
+      token t(token::OTHER, ws, stringify(args[o.index], buffer_, arena_));
+      append_tokens(arena_, repl, &t, &t + 1, ws, paste);
+      break;
+    }
+    case op::PASTE:
+      paste = true;
       break;
     }
   }
 
-  // Macro definition not found.
-  return nullptr;
+  // Paste tokens around the ## operators from the arguments.
+  if (stray)
+    paste_tokens(arena_, repl);
+
+  // Remove placemarkers.
+  if (placemarkers)
+    repl.erase(
+        std::remove_if(repl.begin(),
+                       repl.end(),
+                       [](const token &t) { return t.kind == token::PLACEMARKER; }),
+        repl.end());
 }
 
-std::string
-macro_expand(const std::string &in, const macro_table *macros, unsigned int lineno) {
+void
+expander::macro_expand(token_stream &tokens) {
+  scratch<invocation> inv(invocations_);
+  const macro_table::define *def;
+  token_stream::iterator prev, curr, next;
+  curr = tokens.begin();
+  while (curr != tokens.end()) {
+    // Pop names from the blacklist if the current token ends the range where their
+    // replacement is forbiden.
+    assert(blacklist_.size() >= curr->pop);
+    if (curr->pop) {
+      blacklist_.resize(blacklist_.size() - curr->pop);
+      curr->pop = 0;
+    }
+
+    // Not an identifier, no replacement.
+    if (curr->kind != token::ID
+        // Expansion forbidden, because at one point found in blacklist.
+        || curr->noexpand) {
+      ++curr;
+      continue;
+    }
+
+    // If found an identifier, check the blacklist.
+    if (blacklist_.contains(curr->sym)) {
+      // Do not replace this token anymore, even if it is re-examined in a context where
+      // it is not blacklisted (C11, 16.3.4 #2).
+      curr->noexpand = true;
+      ++curr;
+      continue;
+    }
+
+    // If not blacklisted, check if there is such a macro definition.
+    if ((def = find_define(*curr)) == nullptr) {
+      ++curr;
+      continue;
+    }
+
+    // Found a macro to expand.
+    const auto &params = def->params();
+    if (params.size() == 0 && scope_ != nullptr && !expanding_object_like_) {
+      // Insert the complete expansion of an object-like macro, unless it depends on the
+      // context.
+      const auto &x = scope_->get_expansion(curr->sym);
+      if (x.context_free
+          && std::none_of(x.deps.cbegin(), x.deps.cend(), [this](symbol sym) {
+               return blacklist_.contains(sym);
+             })) {
+        for (auto sym : x.deps)
+          add_dependency(sym);
+        next = std::next(curr);
+        if (x.tokens.empty()) {
+          if (next != tokens.end())
+            next->ws = curr->ws;
+        } else {
+          auto first = tokens.insert(curr, x.tokens.cbegin(), x.tokens.cend());
+          first->ws = curr->ws;
+        }
+        tokens.erase(curr);
+        curr = next;
+        continue;
+      }
+    }
+    if (params.size() == 0) {
+      // Object-like macro.
+      const auto &body = get_body(def).tokens;
+      next = std::next(curr);
+      if (body.empty()) {
+        if (next != tokens.end())
+          next->ws = curr->ws;
+        curr = tokens.erase(curr);
+      } else {
+        blacklist_.push_back(curr->sym);
+        if (next != tokens.end())
+          ++next->pop;
+        prev = tokens.insert(curr, body.cbegin(), body.cend());
+        prev->ws = curr->ws;
+        tokens.erase(curr);
+        curr = prev;
+      }
+    } else {
+      // Function-like macro. If the next token is an opening parenthesis, expand the
+      // macro, otherwise skip the name.
+      next = std::next(curr);
+      if (next != tokens.end() && next->kind == token::OTHER && next->text == "(") {
+        // Gather arguments.
+        bool variadic = params.size() && params.back() == "...";
+        auto &args = inv->args;
+        args.clear();
+        next = gather_arguments(tokens, next, variadic, params.size(), args);
+        // Check the number of actual arguments matches the number of macro parameters.
+        if (variadic) {
+          // A variadic macro should have an argument for every named parameter.
+          if (args.size() < params.size() - 1)
+            throw "Insufficient number of arguments";
+          // "Pad" the arguments list with an empty one.
+          args.pad(params.size());
+        } else {
+          if (args.size() == params.size()) {
+            // A function-like macro with empty parameter list must be given a single
+            // empty argument.
+            if (params.size() == 1 && params[0].empty() && !args[0].empty()) {
+              throw "Too many macro arguments";
+            }
+          } else if (args.size() > params.size()) {
+            throw "Too many macro arguments";
+          } else {
+            throw "Insufficient number of arguments";
+          }
+        }
+        // Perform parameter substitution, stringification and token pasting.
+        substitute_parameters(*inv, get_body(def));
+        const auto &repl = inv->repl;
+        // Rescan/repeat expand.
+        if (repl.empty()) {
+          if (next != tokens.end())
+            next->ws = curr->ws;
+          curr = tokens.erase(curr, next);
+        } else {
+          blacklist_.push_back(curr->sym);
+          if (next != tokens.end())
+            ++next->pop;
+          bool ws = curr->ws;
+          curr = tokens.insert(tokens.erase(curr, next), repl.cbegin(), repl.cend());
+          curr->ws = ws;
+        }
+      } else {
+        ++curr;
+      }
+    }
+  }
+}
+
+void
+expander::add_dependency(symbol sym) {
+  // Identifiers, which were never interned, are not macro names.
+  if (sym != 0 && is_dep_.insert(sym))
+    deps_.push_back(sym);
+}
+
+const macro_table::define *
+expander::find_define(token &tok) {
+  // Names in other sources need not be interned. Intern the macro names, when found, so
+  // they can be blacklisted.
+  if (source_ != nullptr) {
+    ++stats_.searched;
+    const auto *def = source_->find_define(tok.text);
+    if (def != nullptr && tok.sym == 0)
+      tok.sym = detail::intern(tok.text);
+    if (tok.sym != 0)
+      add_dependency(tok.sym);
+    return def;
+  }
+
+  // Most identifiers are not macro names and are rejected by the filter. The result of
+  // the expansion does not depend on them.
+  symbol sym = tok.sym;
+  if (scope_ == nullptr && !macros_->may_define(sym)) {
+    ++stats_.filtered;
+    return nullptr;
+  }
+  ++stats_.searched;
+  add_dependency(sym);
+  if (scope_ != nullptr)
+    return scope_->find_define(sym);
+  return macros_->find_define(lineno_, sym);
+}
+
+void
+expander::use(const macro_table *macros, unsigned int lineno) {
+  macros_ = macros;
+  lineno_ = lineno;
+  scope_ = nullptr;
+  source_ = nullptr;
+}
+
+void
+expander::use(const definition_source &source) {
+  macros_ = nullptr;
+  lineno_ = 0;
+  scope_ = nullptr;
+  source_ = &source;
+}
+
+void
+expander::use(const macro_scope &scope) {
+  macros_ = nullptr;
+  lineno_ = 0;
+  scope_ = &scope;
+  source_ = nullptr;
+}
+
+void
+expander::expand_object_like(const macro_scope &scope, symbol sym, object_expansion &x) {
+  reset();
+  macros_ = nullptr;
+  lineno_ = 0;
+  scope_ = &scope;
+  source_ = nullptr;
+  expanding_object_like_ = true;
+
+  const auto *def = scope.find_define(sym);
+  assert(def != nullptr && def->params().size() == 0);
+  token_stream tokens{token_stream::allocator_type(arena_)};
+  token t(token::ID, false, def->name());
+  t.sym = sym;
+  tokens.push_back(t);
+  // Expand the macro name alone. The expansion may fail only if it depends on the
+  // following tokens.
+  try {
+    macro_expand(tokens);
+    x.context_free = true;
+  } catch (...) {
+    x.context_free = false;
+  }
+  // A trailing name of a function-like macro may form an invocation with the following
+  // tokens.
+  if (x.context_free && !tokens.empty()) {
+    const auto &last = tokens.back();
+    if (last.kind == token::ID && !last.noexpand) {
+      const auto *d = scope.find_define(last.sym);
+      x.context_free = d == nullptr || d->params().size() == 0;
+    }
+  }
+  if (!x.context_free)
+    return;
+
+  x.deps = deps_;
+  for (const auto &t : tokens) {
+    x.tokens.push_back(t);
+    x.tokens.back().text = detail::copy_text(x.text, t.text.begin(), t.text.end());
+  }
+}
+
+template<typename Output>
+void
+expander::expand(string_ref in, Output &out) {
+  reset();
+
   // Tokenize the input string.
-  auto tokens = tokenize(in.cbegin(), in.cend(), false, false);
+  token_stream tokens{token_stream::allocator_type(arena_)};
+  tokenize(in.data(), in.data() + in.size(), false, false, tokens);
 
   // Perform the expansion.
-  std::vector<std::string> blacklist;
-  macro_expand(blacklist, macros, lineno, tokens);
+  macro_expand(tokens);
 
-  // Construct and return the output string.
-  std::string out;
+  emit(tokens, out);
+}
+
+namespace {
+
+// Get the length of the text of the tokens.
+size_t
+output_size(const token_stream &tokens) {
+  size_t n = 0;
+  for (const auto &t : tokens)
+    n += t.ws + t.text.size();
+  return n;
+}
+
+}  // end namespace
+
+// Construct the output string.
+void
+expander::emit(const token_stream &tokens, std::string &out) {
+  out.clear();
+  out.reserve(output_size(tokens));
   for (const auto &t : tokens) {
     assert(t.kind == token::ID || t.kind == token::OTHER);
     if (t.ws)
       out += ' ';
-    out += t.text;
+    out.append(t.text.data(), t.text.size());
+  }
+}
+
+void
+expander::emit(const token_stream &tokens, expansion_sink &out) {
+  out.reserve(output_size(tokens));
+  for (const auto &t : tokens) {
+    assert(t.kind == token::ID || t.kind == token::OTHER);
+    if (t.ws)
+      out.write(" ", 1);
+    out.write(t.text.data(), t.text.size());
+  }
+}
+
+void
+expander::reset() {
+  blacklist_.resize(0);
+  is_dep_.clear();
+  deps_.clear();
+  // Release the token list nodes, kept by the scratch objects, before releasing the
+  // memory they occupy.
+  for (auto &inv : invocations_) {
+    for (auto &cpy : inv->expanded)
+      cpy.clear();
+  }
+  arena_.reset();
+}
+
+}  // end namespace detail
+
+namespace {
+
+// Insert an element in a vector, ordered by line number. Elements with equal line
+// numbers are kept in insertion order.
+template<typename T>
+void
+insert_by_lineno(std::vector<T> &v, const T &x) {
+  // Shortcut for the common case of elements inserted in increasing line number order.
+  if (v.empty() || v.back().lineno <= x.lineno) {
+    v.push_back(x);
+    return;
+  }
+  auto pos = std::upper_bound(
+      v.begin(), v.end(), x.lineno, [](unsigned int l, const T &e) {
+        return l < e.lineno;
+      });
+  v.insert(pos, x);
+}
+
+// Insert an element in a vector, ordered by line number and sequence number.
+template<typename T>
+void
+insert_by_seq(std::vector<T> &v, const T &x) {
+  auto pos = std::upper_bound(v.begin(), v.end(), x, [](const T &a, const T &b) {
+    return a.lineno < b.lineno || (a.lineno == b.lineno && a.seq < b.seq);
+  });
+  v.insert(pos, x);
+}
+
+// Number of modifications of all the macro tables.
+std::atomic<size_t> global_generation(0);
+
+// Find the first element with line number greater than or equal to the given one. Line
+// number 0 means past the last element.
+template<typename T>
+typename std::vector<T>::const_iterator
+find_by_lineno(const std::vector<T> &v, unsigned int lineno) {
+  if (lineno == 0)
+    return v.cend();
+  return std::lower_bound(v.cbegin(), v.cend(), lineno, [](const T &e, unsigned int l) {
+    return e.lineno < l;
+  });
+}
+
+}  // end namespace
+
+macro_table::macro_table()
+    : text_(new detail::arena),
+      generation_(std::make_shared<size_t>(0)),
+      filter_(nullptr) {}
+
+macro_table::~macro_table() {
+  // Invalidate the snapshots, e.g. of an expansion cache, which outlive the table.
+  ++*generation_;
+  global_generation.fetch_add(1, std::memory_order_release);
+}
+
+void
+macro_table::add_entry(unsigned int lineno, kind k, const void *item) {
+  ++*generation_;
+  global_generation.fetch_add(1, std::memory_order_release);
+  // Lookups do not run during modifications, hence nothing uses the filters.
+  filter_.store(nullptr, std::memory_order_relaxed);
+  filters_.clear();
+
+  // Shortcut for the common case of entries made in increasing line number order.
+  if (lines_.empty() || lines_.back() <= lineno) {
+    lines_.push_back(lineno);
+    kinds_.push_back(k);
+    items_.push_back(item);
+    return;
+  }
+
+  // Slow path
+  auto i = std::upper_bound(lines_.begin(), lines_.end(), lineno) - lines_.begin();
+  lines_.insert(lines_.begin() + i, lineno);
+  kinds_.insert(kinds_.begin() + i, k);
+  items_.insert(items_.begin() + i, item);
+}
+
+const char *
+macro_table::copy_text(const char *text, size_t size) {
+  auto *p = static_cast<char *>(text_->allocate(size, 1));
+  std::memcpy(p, text, size);
+  return p;
+}
+
+void
+macro_table::add_define(unsigned int lineno, const std::string &def) {
+  add_define(lineno, def.data(), def.size());
+}
+
+void
+macro_table::add_define(unsigned int lineno, const char *def, size_t size) {
+  add_define_ref(lineno, copy_text(def, size), size);
+}
+
+void
+macro_table::add_define_ref(unsigned int lineno, const char *def, size_t size) {
+  defines_.emplace_back();
+  auto *d = &defines_.back();
+  d->text = def;
+  d->size = size;
+  add_entry(lineno, DEFINE, d);
+  index_name(lineno, detail::intern(macro_name(detail::string_ref(def, size))), d);
+}
+
+void
+macro_table::add_undefine(unsigned int lineno, const std::string &name) {
+  add_undefine(lineno, name.data(), name.size());
+}
+
+void
+macro_table::add_undefine(unsigned int lineno, const char *name, size_t size) {
+  undefines_.push_back(undefine{copy_text(name, size), size});
+  add_entry(lineno, UNDEFINE, &undefines_.back());
+  index_name(lineno, detail::intern(detail::string_ref(name, size)), nullptr);
+}
+
+void
+macro_table::add_include(unsigned int lineno, const included_macros *nested) {
+  add_entry(lineno, INCLUDE, nested);
+  insert_by_lineno(
+      includes_,
+      include_version{lineno, static_cast<unsigned int>(lines_.size()), nested});
+}
+
+void
+macro_table::add_include(unsigned int lineno,
+                         std::shared_ptr<const included_macros> nested) {
+  add_include(lineno, nested.get());
+  shared_includes_.push_back(std::move(nested));
+}
+
+void
+macro_table::index_name(unsigned int lineno, detail::symbol sym, const define *def) {
+  insert_by_lineno(index_[sym],
+                   version{lineno, static_cast<unsigned int>(lines_.size()), def});
+}
+
+std::vector<const macro_table *>
+macro_table::reachable(const macro_table *root) {
+  std::vector<const macro_table *> tables{root};
+  std::unordered_set<const macro_table *> visited{root};
+  for (size_t i = 0; i < tables.size(); ++i) {
+    for (const auto &inc : tables[i]->includes_) {
+      auto *t = inc.include->get_macros();
+      if (visited.insert(t).second)
+        tables.push_back(t);
+    }
+  }
+  return tables;
+}
+
+macro_table::snapshot::snapshot(const macro_table *root) {
+  verified.store(global_generation.load(std::memory_order_acquire),
+                 std::memory_order_relaxed);
+  for (auto *t : reachable(root))
+    tables.emplace_back(t->generation_, *t->generation_);
+}
+
+bool
+macro_table::snapshot::is_current() const {
+  auto g = global_generation.load(std::memory_order_acquire);
+  if (verified.load(std::memory_order_relaxed) == g)
+    return true;
+  // Some table was modified. Check it is not one of ours.
+  for (const auto &t : tables) {
+    if (*t.first != t.second)
+      return false;
+  }
+  verified.store(g, std::memory_order_relaxed);
+  return true;
+}
+
+void
+macro_table::flatten() {
+  flat_.reset();
+  std::unique_ptr<flat_view> flat(new flat_view(this));
+  const search_path here{this, nullptr};
+
+  // Merge the definitions, visible at the end of each included table, at the position
+  // of the include directive. Undefined names in the included tables do not shadow
+  // earlier definitions, as in the unflattened lookup.
+  flat->index = index_;
+  typedef std::vector<std::pair<detail::symbol, const define *>> define_list;
+  std::unordered_map<const macro_table *, define_list> visible;
+  for (const auto &inc : includes_) {
+    auto *nested = inc.include->get_macros();
+    auto r = visible.emplace(nested, define_list());
+    auto &defs = r.first->second;
+    if (r.second) {
+      std::unordered_set<detail::symbol> names;
+      for (auto *t : reachable(nested)) {
+        for (const auto &h : t->index_)
+          names.insert(h.first);
+      }
+      for (auto sym : names) {
+        if (const define *d = nested->find_define(0, sym, &here))
+          defs.emplace_back(sym, d);
+      }
+    }
+    for (const auto &d : defs)
+      insert_by_seq(flat->index[d.first], version{inc.lineno, inc.seq, d.second});
+  }
+
+  flat_ = std::move(flat);
+}
+
+const macro_table::flat_view *
+macro_table::get_flat_view() const {
+  return flat_ && flat_->tables.is_current() ? flat_.get() : nullptr;
+}
+
+const detail::name_filter *
+macro_table::get_filter() const {
+  auto *filter = filter_.load(std::memory_order_acquire);
+  if (filter != nullptr && filter->tables.is_current())
+    return filter;
+
+  std::lock_guard<std::mutex> lock(filter_mutex_);
+  filter = filter_.load(std::memory_order_relaxed);
+  if (filter != nullptr && filter->tables.is_current())
+    return filter;
+  // Collect the defined names first, to size the filter.
+  std::vector<detail::symbol> names;
+  for (auto *t : reachable(this)) {
+    for (const auto &h : t->index_) {
+      if (std::any_of(h.second.cbegin(), h.second.cend(), [](const version &v) {
+            return v.def != nullptr;
+          }))
+        names.push_back(h.first);
+    }
+  }
+  std::unique_ptr<detail::name_filter> f(new detail::name_filter(this, names.size()));
+  for (auto sym : names)
+    f->insert(sym);
+  // The replaced filter is stale after modifications of the included tables, but
+  // concurrent lookups may still be checking it. It is kept until this table is
+  // modified.
+  filters_.emplace_back(f.release());
+  filter = filters_.back().get();
+  filter_.store(filter, std::memory_order_release);
+  return filter;
+}
+
+macro_table::line_range
+macro_table::equivalent_lines(unsigned int lineno,
+                              const std::vector<detail::symbol> &names) const {
+  if (lineno == 0)
+    return line_range{0, 1};
+
+  // A directive at line N takes effect at line N + 1. Find the closest directives,
+  // which may change the definition of any of the names, before and after the line.
+  line_range r{1, std::numeric_limits<unsigned int>::max()};
+  auto add_change = [&r, lineno](unsigned int n) {
+    if (n < lineno)
+      r.begin = std::max(r.begin, n + 1);
+    else
+      r.end = std::min(r.end, n + 1);
+  };
+  for (auto sym : names) {
+    auto h = index_.find(sym);
+    if (h != index_.end()) {
+      auto i = find_by_lineno(h->second, lineno);
+      if (i != h->second.cbegin())
+        add_change((i - 1)->lineno);
+      if (i != h->second.cend())
+        add_change(i->lineno);
+    }
+    // Included tables may define the name.
+    auto i = find_by_lineno(includes_, lineno);
+    for (auto j = i; j != includes_.cbegin();) {
+      --j;
+      if (j->include->get_macros()->may_define(sym)) {
+        add_change(j->lineno);
+        break;
+      }
+    }
+    for (auto j = i; j != includes_.cend(); ++j) {
+      if (j->include->get_macros()->may_define(sym)) {
+        add_change(j->lineno);
+        break;
+      }
+    }
+  }
+  return r;
+}
+
+bool
+macro_table::may_define(detail::symbol sym) const {
+  return sym != 0 && get_filter()->contains(sym);
+}
+
+namespace {
+
+// Estimate the memory, used by a hash table of versions.
+template<typename Map>
+size_t
+index_memory(const Map &index) {
+  size_t n = index.bucket_count() * sizeof(void *)
+             + index.size() * (sizeof(void *) + sizeof(typename Map::value_type));
+  for (const auto &h : index)
+    n += h.second.capacity() * sizeof(typename Map::mapped_type::value_type);
+  return n;
+}
+
+}  // end namespace
+
+macro_table::memory_stats
+macro_table::memory_usage() const {
+  memory_stats m{0, 0, 0, 0};
+  m.directives = lines_.capacity() * sizeof(unsigned int)
+                 + kinds_.capacity() * sizeof(kind)
+                 + items_.capacity() * sizeof(const void *)
+                 + defines_.size() * sizeof(define)
+                 + undefines_.size() * sizeof(undefine)
+                 + includes_.capacity() * sizeof(include_version);
+  m.text = text_->capacity();
+
+  m.index = index_memory(index_);
+  if (flat_)
+    m.index += sizeof(flat_view) + index_memory(flat_->index);
+  std::lock_guard<std::mutex> lock(filter_mutex_);
+  for (const auto &f : filters_)
+    m.index += sizeof(detail::name_filter) + f->bits.capacity() * sizeof(uint64_t);
+
+  for (const auto &d : defines_) {
+    if (auto *def = d.def.load(std::memory_order_acquire)) {
+      m.parsed += sizeof(*def) + def->name.capacity() + def->repl.capacity()
+                  + def->params.capacity() * sizeof(std::string);
+      for (const auto &p : def->params)
+        m.parsed += p.capacity();
+    }
+    if (auto *body = d.body.load(std::memory_order_acquire)) {
+      m.parsed += sizeof(*body) + body->tokens.capacity() * sizeof(detail::token)
+                  + body->program.capacity() * sizeof(detail::macro_body::op);
+    }
+  }
+  return m;
+}
+
+namespace {
+
+void
+hash_combine(size_t &h, size_t v) {
+  h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+}
+
+}  // end namespace
+
+// Get a hash of the directives of the table. Included tables are hashed by identity.
+size_t
+macro_table::content_hash() const {
+  detail::string_ref_hash hash_string;
+  size_t h = lines_.size();
+  for (size_t i = 0; i < lines_.size(); ++i) {
+    hash_combine(h, kinds_[i]);
+    hash_combine(h, lines_[i]);
+    switch (kinds_[i]) {
+    case DEFINE: {
+      auto *d = static_cast<const define *>(items_[i]);
+      hash_combine(h, hash_string(detail::string_ref(d->text, d->size)));
+      break;
+    }
+    case UNDEFINE: {
+      auto *u = static_cast<const undefine *>(items_[i]);
+      hash_combine(h, hash_string(detail::string_ref(u->name, u->size)));
+      break;
+    }
+    case INCLUDE: {
+      auto *inc = static_cast<const included_macros *>(items_[i]);
+      hash_combine(h, std::hash<const macro_table *>()(inc->get_macros()));
+      break;
+    }
+    }
+  }
+  return h;
+}
+
+bool
+macro_table::same_directives(const macro_table &other) const {
+  if (lines_ != other.lines_ || kinds_ != other.kinds_)
+    return false;
+  for (size_t i = 0; i < lines_.size(); ++i) {
+    switch (kinds_[i]) {
+    case DEFINE: {
+      auto *a = static_cast<const define *>(items_[i]);
+      auto *b = static_cast<const define *>(other.items_[i]);
+      if (detail::string_ref(a->text, a->size) != detail::string_ref(b->text, b->size))
+        return false;
+      break;
+    }
+    case UNDEFINE: {
+      auto *a = static_cast<const undefine *>(items_[i]);
+      auto *b = static_cast<const undefine *>(other.items_[i]);
+      if (detail::string_ref(a->name, a->size) != detail::string_ref(b->name, b->size))
+        return false;
+      break;
+    }
+    case INCLUDE: {
+      auto *a = static_cast<const included_macros *>(items_[i]);
+      auto *b = static_cast<const included_macros *>(other.items_[i]);
+      if (a->get_macros() != b->get_macros())
+        return false;
+      break;
+    }
+    }
+  }
+  return true;
+}
+
+macro_table::define::define() : text(nullptr), size(0), def(nullptr), body(nullptr) {}
+
+macro_table::define::~define() {
+  delete def.load(std::memory_order_relaxed);
+  delete body.load(std::memory_order_relaxed);
+}
+
+// Parse the definition on first use.
+const detail::macro_def &
+macro_table::define::parse() const {
+  std::unique_ptr<detail::macro_def> d(new detail::macro_def);
+  parse_macro_def(detail::string_ref(text, size), d->name, d->params, d->repl);
+  detail::macro_def *expected = nullptr;
+  if (def.compare_exchange_strong(expected, d.get(), std::memory_order_acq_rel))
+    return *d.release();
+  return *expected;
+}
+
+const macro_table::define *
+macro_table::find_define(unsigned int lineno, string_ref name) const {
+  return find_define(lineno, detail::find_symbol(name));
+}
+
+const macro_table::define *
+macro_table::find_define(unsigned int lineno, detail::symbol sym) const {
+  return find_define(lineno, sym, nullptr);
+}
+
+const macro_table::define *
+macro_table::find_define(unsigned int lineno,
+                         detail::symbol sym,
+                         const search_path *path) const {
+  // A name, which was never interned, is not defined anywhere.
+  if (sym == 0 || lines_.empty())
+    return nullptr;
+
+  // Search in the flattened directives, if available.
+  if (path == nullptr) {
+    if (const flat_view *flat = get_flat_view()) {
+      auto h = flat->index.find(sym);
+      if (h == flat->index.end())
+        return nullptr;
+      auto i = find_by_lineno(h->second, lineno);
+      return i == h->second.cbegin() ? nullptr : (i - 1)->def;
+    }
+  }
+
+  // Protect from cycles in the incuded files.
+  for (auto p = path; p != nullptr; p = p->next) {
+    if (p->table == this)
+      return nullptr;
+  }
+  const search_path here{this, path};
+
+  // Find the last define or undefine directive for the name, preceding the given line.
+  const version *v = nullptr;
+  auto h = index_.find(sym);
+  if (h != index_.end()) {
+    auto i = find_by_lineno(h->second, lineno);
+    if (i != h->second.cbegin())
+      v = &*(i - 1);
+  }
+
+  // Search among the directives in the files, included after that directive, starting
+  // from the latest one.
+  auto i = find_by_lineno(includes_, lineno);
+  while (i != includes_.cbegin()) {
+    --i;
+    if (v != nullptr
+        && (i->lineno < v->lineno || (i->lineno == v->lineno && i->seq < v->seq)))
+      break;
+    if (const define *d = i->include->get_macros()->find_define(0, sym, &here))
+      return d;
+  }
+
+  // Found a macro definition for the name, or an undefine directive.
+  if (v != nullptr)
+    return v->def;
+
+  // Macro definition not found.
+  return nullptr;
+}
+
+macro_table_builder::macro_table_builder() : text_(new detail::arena) {}
+
+macro_table_builder::~macro_table_builder() {}
+
+void
+macro_table_builder::add_define(unsigned int lineno, const std::string &def) {
+  add_define(lineno, def.data(), def.size());
+}
+
+void
+macro_table_builder::add_undefine(unsigned int lineno, const std::string &name) {
+  add_undefine(lineno, name.data(), name.size());
+}
+
+void
+macro_table_builder::add_define(unsigned int lineno, const char *def, size_t size) {
+  auto text = detail::copy_text(*text_, def, def + size);
+  records_.push_back(record{lineno, record::DEFINE, text.data(), size, nullptr});
+}
+
+void
+macro_table_builder::add_undefine(unsigned int lineno, const char *name, size_t size) {
+  auto text = detail::copy_text(*text_, name, name + size);
+  records_.push_back(record{lineno, record::UNDEFINE, text.data(), size, nullptr});
+}
+
+void
+macro_table_builder::add_include(unsigned int lineno, const included_macros *nested) {
+  records_.push_back(record{lineno, record::INCLUDE, nullptr, 0, nested});
+}
+
+std::unique_ptr<macro_table>
+macro_table_builder::build() {
+  typedef macro_table::version version;
+  typedef macro_table::include_version include_version;
+
+  // Order the directives by line number. Directives with equal line numbers are kept in
+  // the order of their addition.
+  std::stable_sort(
+      records_.begin(), records_.end(), [](const record &a, const record &b) {
+        return a.lineno < b.lineno;
+      });
+
+  // The table takes over the text of the directives.
+  std::unique_ptr<macro_table> t(new macro_table);
+  t->text_ = std::move(text_);
+  text_.reset(new detail::arena);
+
+  t->lines_.reserve(records_.size());
+  t->kinds_.reserve(records_.size());
+  t->items_.reserve(records_.size());
+  for (size_t i = 0; i < records_.size(); ++i) {
+    const auto &r = records_[i];
+    auto seq = static_cast<unsigned int>(i + 1);
+    t->lines_.push_back(r.lineno);
+    // Directives are indexed in line order, hence always appended to the histories.
+    switch (r.kind) {
+    case record::DEFINE: {
+      t->defines_.emplace_back();
+      auto *d = &t->defines_.back();
+      d->text = r.text;
+      d->size = r.size;
+      t->kinds_.push_back(macro_table::DEFINE);
+      t->items_.push_back(d);
+      auto sym = detail::intern(macro_name(detail::string_ref(d->text, d->size)));
+      t->index_[sym].push_back(version{r.lineno, seq, d});
+      break;
+    }
+    case record::UNDEFINE: {
+      t->undefines_.push_back(macro_table::undefine{r.text, r.size});
+      t->kinds_.push_back(macro_table::UNDEFINE);
+      t->items_.push_back(&t->undefines_.back());
+      auto sym = detail::intern(detail::string_ref(r.text, r.size));
+      t->index_[sym].push_back(version{r.lineno, seq, nullptr});
+      break;
+    }
+    case record::INCLUDE:
+      t->kinds_.push_back(macro_table::INCLUDE);
+      t->items_.push_back(r.include);
+      t->includes_.push_back(include_version{r.lineno, seq, r.include});
+      break;
+    }
+  }
+  records_.clear();
+
+  *t->generation_ = 1;
+  global_generation.fetch_add(1, std::memory_order_release);
+  return t;
+}
+
+class macro_table_registry::shared_table : public included_macros {
+public:
+  explicit shared_table(std::unique_ptr<macro_table> t) : table(std::move(t)) {}
+
+  const macro_table *
+  get_macros() const override {
+    return table.get();
+  }
+
+  std::unique_ptr<macro_table> table;
+};
+
+macro_table_registry::macro_table_registry() {}
+
+macro_table_registry::~macro_table_registry() {}
+
+std::shared_ptr<const included_macros>
+macro_table_registry::intern(std::unique_ptr<macro_table> table) {
+  auto hash = table->content_hash();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &bucket = tables_[hash];
+  for (auto i = bucket.begin(); i != bucket.end();) {
+    if (auto shared = i->lock()) {
+      if (shared->table->same_directives(*table))
+        return shared;
+      ++i;
+    } else {
+      // Drop the tables, no longer in use.
+      i = bucket.erase(i);
+    }
+  }
+  auto shared = std::make_shared<const shared_table>(std::move(table));
+  bucket.push_back(shared);
+  return shared;
+}
+
+size_t
+macro_table_registry::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t n = 0;
+  for (const auto &bucket : tables_) {
+    for (const auto &t : bucket.second)
+      n += !t.expired();
+  }
+  return n;
+}
+
+macro_scope::macro_scope(const macro_table *macros, unsigned int lineno) {
+  // Look up every name, which is defined at some line of the reachable tables.
+  std::unordered_set<detail::symbol> seen;
+  for (const auto *t : macro_table::reachable(macros)) {
+    for (const auto &h : t->index_) {
+      if (!std::any_of(h.second.cbegin(),
+                       h.second.cend(),
+                       [](const macro_table::version &v) { return v.def != nullptr; }))
+        continue;
+      if (!seen.insert(h.first).second)
+        continue;
+      if (const auto *d = macros->find_define(lineno, h.first))
+        defs_.emplace(std::piecewise_construct,
+                      std::forward_as_tuple(h.first),
+                      std::forward_as_tuple(d));
+    }
+  }
+}
+
+macro_scope::~macro_scope() {
+  for (auto &b : defs_)
+    delete b.second.expansion.load(std::memory_order_relaxed);
+}
+
+const macro_table::define *
+macro_scope::find_define(string_ref name) const {
+  return find_define(detail::find_symbol(name));
+}
+
+// Concurrent callers may expand the same macro, only one of the results is kept.
+const detail::object_expansion &
+macro_scope::get_expansion(detail::symbol sym) const {
+  const auto &b = defs_.find(sym)->second;
+  if (auto *x = b.expansion.load(std::memory_order_acquire))
+    return *x;
+  std::unique_ptr<detail::object_expansion> x(new detail::object_expansion);
+  detail::expander().expand_object_like(*this, sym, *x);
+  detail::object_expansion *expected = nullptr;
+  if (b.expansion.compare_exchange_strong(expected, x.get(), std::memory_order_acq_rel))
+    return *x.release();
+  return *expected;
+}
+
+expansion_context::expansion_context() : impl_(new detail::expander) {}
+
+expansion_context::~expansion_context() {
+  delete impl_;
+}
+
+void
+expansion_context::expand(string_ref in,
+                          const macro_table *macros,
+                          unsigned int lineno,
+                          std::string &out) {
+  impl_->use(macros, lineno);
+  impl_->expand(in, out);
+}
+
+void
+expansion_context::expand(string_ref in,
+                          const macro_scope &scope,
+                          std::string &out) {
+  impl_->use(scope);
+  impl_->expand(in, out);
+}
+
+void
+expansion_context::expand(string_ref in,
+                          const detail::definition_source &source,
+                          std::string &out) {
+  impl_->use(source);
+  impl_->expand(in, out);
+}
+
+void
+expansion_context::expand(string_ref in,
+                          const macro_table *macros,
+                          unsigned int lineno,
+                          expansion_sink &out) {
+  impl_->use(macros, lineno);
+  impl_->expand(in, out);
+}
+
+void
+expansion_context::expand(string_ref in, const macro_scope &scope, expansion_sink &out) {
+  impl_->use(scope);
+  impl_->expand(in, out);
+}
+
+void
+expansion_context::expand(string_ref in,
+                          const detail::definition_source &source,
+                          expansion_sink &out) {
+  impl_->use(source);
+  impl_->expand(in, out);
+}
+
+void
+expansion_context::reset() {
+  impl_->reset();
+}
+
+
+const std::vector<detail::symbol> &
+expansion_context::dependencies() const {
+  return impl_->dependencies();
+}
+
+const lookup_stats &
+expansion_context::stats() const {
+  return impl_->stats();
+}
+
+expansion_cache::expansion_cache(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 1)), hits_(0), misses_(0) {}
+
+expansion_cache::~expansion_cache() {}
+
+const std::string &
+expansion_cache::expand(string_ref in,
+                        const macro_table *macros,
+                        unsigned int lineno) {
+  // Get the current snapshot of the table. Entries with other snapshots are stale.
+  auto &tables = tables_[macros];
+  if (!tables || !tables->is_current())
+    tables = std::make_shared<const macro_table::snapshot>(macros);
+
+  auto &index = index_[detail::string_ref_hash()(in)];
+  for (auto e : index) {
+    if (e->macros == macros && e->tables == tables && e->lines.contains(lineno)
+        && string_ref(e->input) == in) {
+      ++hits_;
+      entries_.splice(entries_.begin(), entries_, e);
+      return e->output;
+    }
   }
+
+  ++misses_;
+  entry e{std::string(in.data(), in.size()), macros, {0, 0}, tables, std::string()};
+  context_.expand(in, macros, lineno, e.output);
+  e.lines = macros->equivalent_lines(lineno, context_.dependencies());
+  entries_.push_front(std::move(e));
+  index.push_back(entries_.begin());
+
+  // Evict the least recently used entry.
+  if (entries_.size() > capacity_) {
+    auto last = std::prev(entries_.end());
+    auto i = index_.find(detail::string_ref_hash()(last->input));
+    auto &v = i->second;
+    v.erase(std::find(v.begin(), v.end(), last));
+    if (v.empty())
+      index_.erase(i);
+    entries_.pop_back();
+  }
+  return entries_.front().output;
+}
+
+void
+expansion_cache::clear() {
+  entries_.clear();
+  index_.clear();
+  tables_.clear();
+}
+
+std::string
+macro_expand(string_ref in, const macro_table *macros, unsigned int lineno) {
+  expansion_context ctx;
+  std::string out;
+  ctx.expand(in, macros, lineno, out);
+  return out;
+}
+
+std::string
+macro_expand(string_ref in, const macro_scope &scope) {
+  expansion_context ctx;
+  std::string out;
+  ctx.expand(in, scope, out);
   return out;
 }
 
+void
+macro_expand(string_ref in,
+             const macro_table *macros,
+             unsigned int lineno,
+             expansion_sink &out) {
+  expansion_context ctx;
+  ctx.expand(in, macros, lineno, out);
+}
+
+void
+macro_expand(string_ref in, const macro_scope &scope, expansion_sink &out) {
+  expansion_context ctx;
+  ctx.expand(in, scope, out);
+}
+
 }  // end namespace
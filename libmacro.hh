@@ -2,8 +2,16 @@
 #ifndef libmacro_hh__
 #define libmacro_hh__ 1
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #ifdef _WIN32
 #if defined(_LIBMACRO_STATIC)
@@ -20,7 +28,81 @@
 #endif
 
 namespace libmacro {
+
+// Reference to a character sequence, stored elsewhere. Names and inputs are passed as
+// string references, so callers need not copy them into strings.
+class string_ref {
+public:
+  string_ref() : data_(nullptr), size_(0) {}
+  string_ref(const char *data, size_t size) : data_(data), size_(size) {}
+  string_ref(const char *str) : data_(str), size_(std::strlen(str)) {}
+  string_ref(const std::string &str) : data_(str.data()), size_(str.size()) {}
+
+  const char *
+  data() const {
+    return data_;
+  }
+
+  size_t
+  size() const {
+    return size_;
+  }
+
+  bool
+  empty() const {
+    return size_ == 0;
+  }
+
+  const char *
+  begin() const {
+    return data_;
+  }
+
+  const char *
+  end() const {
+    return data_ + size_;
+  }
+
+  char operator[](size_t i) const { return data_[i]; }
+
+private:
+  const char *data_;
+  size_t size_;
+};
+
+inline bool
+operator==(string_ref a, string_ref b) {
+  return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool
+operator!=(string_ref a, string_ref b) {
+  return !(a == b);
+}
+
+namespace detail {
+// Identifiers are represented by small integer symbols. Zero is not a valid symbol.
+// Symbols are process-wide, so they compare equal across tables: the names of the
+// directives and the identifiers in the replacement lists are interned once and kept
+// until the process exits, also after their tables are destroyed. Each distinct name
+// costs about 64 bytes, plus its text, if longer than 15 characters.
+typedef unsigned int symbol;
+class arena;
+struct macro_body;
+
+// Parts of a macro definition, parsed once.
+struct macro_def {
+  std::string name;
+  std::vector<std::string> params;
+  std::string repl;
+};
+struct name_filter;
+struct object_expansion;
+class expander;
+}
+
 class macro_table;
+class macro_image;
 class included_macros {
 public:
   virtual const macro_table *get_macros() const = 0;
@@ -28,49 +110,531 @@ public:
 
 class macro_table {
 public:
-  macro_table() : in_use_(false) {}
+  macro_table();
 
   ~macro_table();
 
   struct define {
-    std::string name;
-    std::vector<std::string> params;
-    std::string repl;
-    mutable bool checked;
+    define();
+    ~define();
+    define(const define &) = delete;
+    define &operator=(const define &) = delete;
+
+    // Get the macro name, the parameters and the replacement list, parsed from the text
+    // of the definition on first use.
+    const std::string &
+    name() const {
+      return get_def().name;
+    }
+
+    const std::vector<std::string> &
+    params() const {
+      return get_def().params;
+    }
+
+    const std::string &
+    repl() const {
+      return get_def().repl;
+    }
+
+    // Text of the definition, owned by the table, or by the user of the table. The
+    // definitions from a macro_image have no text and are created parsed.
+    const char *text;
+    size_t size;
+    // Parsed definition, created on first use.
+    mutable std::atomic<detail::macro_def *> def;
+    // Tokenized and verified replacement list, created on first use.
+    mutable std::atomic<detail::macro_body *> body;
+
+  private:
+    const detail::macro_def &
+    get_def() const {
+      if (auto *d = def.load(std::memory_order_acquire))
+        return *d;
+      return parse();
+    }
+
+    _LIBMACRO_EXPORT const detail::macro_def &parse() const;
   };
 
   _LIBMACRO_EXPORT void add_define(unsigned int, const std::string &);
   _LIBMACRO_EXPORT void add_undefine(unsigned int, const std::string &);
   _LIBMACRO_EXPORT void add_include(unsigned int, const included_macros *);
 
-  _LIBMACRO_EXPORT const define *find_define(unsigned int, const std::string &) const;
+  // Include a table with shared ownership. The included table is kept alive at least as
+  // long as this one.
+  _LIBMACRO_EXPORT void add_include(unsigned int, std::shared_ptr<const included_macros>);
+
+  // Add directives from character sequences, which need not be null-terminated.
+  _LIBMACRO_EXPORT void add_define(unsigned int, const char *, size_t);
+  _LIBMACRO_EXPORT void add_undefine(unsigned int, const char *, size_t);
+
+  // Add a define directive, referring to a character sequence, which must outlive the
+  // table, instead of copying it.
+  _LIBMACRO_EXPORT void add_define_ref(unsigned int, const char *, size_t);
+
+  // Resolve the include directives ahead of time, so lookups do not search in the
+  // included tables. The result is discarded as soon as this table or any of the
+  // (transitively) included tables is modified, until the next call.
+  _LIBMACRO_EXPORT void flatten();
+
+  // Find the definition of a name, visible at a line. Looking up a name does not
+  // allocate memory.
+  _LIBMACRO_EXPORT const define *find_define(unsigned int, string_ref) const;
+  _LIBMACRO_EXPORT const define *find_define(unsigned int, detail::symbol) const;
+
+  // Range of line numbers [BEGIN, END).
+  struct line_range {
+    unsigned int begin;
+    unsigned int end;
+
+    bool
+    contains(unsigned int lineno) const {
+      return begin <= lineno && lineno < end;
+    }
+  };
+
+  // Get the range of lines, at which the names have the same definitions as at line
+  // LINENO. Line number zero is equivalent only to itself.
+  _LIBMACRO_EXPORT line_range equivalent_lines(unsigned int lineno,
+                                               const std::vector<detail::symbol> &) const;
+
+  // Check if the names have the same definitions at two lines. An expansion yields the
+  // same result at both lines, if they are equivalent for the names it depends on.
+  bool
+  equivalent(unsigned int a, unsigned int b, const std::vector<detail::symbol> &names)
+      const {
+    return a == b || equivalent_lines(a, names).contains(b);
+  }
+
+  // Check if a name may have a definition in the table or in the (transitively)
+  // included tables, at any line. False positives are possible, false negatives are
+  // not.
+  _LIBMACRO_EXPORT bool may_define(detail::symbol) const;
+
+  // Memory, used by a table, in bytes. Sizes of the standard containers are estimated.
+  struct memory_stats {
+    // Directives and the text of the definitions.
+    size_t directives;
+    size_t text;
+    // Indices for lookups, including the flattened view and the name filter.
+    size_t index;
+    // Definitions, parsed, tokenized and compiled on first use.
+    size_t parsed;
+
+    size_t
+    total() const {
+      return directives + text + index + parsed;
+    }
+  };
+
+  // Get the memory, used by the table, not including the included tables.
+  _LIBMACRO_EXPORT memory_stats memory_usage() const;
 
 protected:
+  friend struct detail::name_filter;
+  friend class macro_scope;
+  friend class expansion_cache;
+  friend class macro_table_builder;
+  friend class macro_table_registry;
+  friend class macro_image;
+
   struct undefine {
-    std::string name;
+    const char *name;
+    size_t size;
+  };
+
+  enum kind : unsigned char { DEFINE, UNDEFINE, INCLUDE };
+
+  // A directive, which may change the definition of a particular name. DEF is null for
+  // an undefine directive.
+  struct version {
+    unsigned int lineno;
+    unsigned int seq;
+    const define *def;
+  };
+
+  // An include directive.
+  struct include_version {
+    unsigned int lineno;
+    unsigned int seq;
+    const included_macros *include;
+  };
+
+  // Chain of the tables, whose lookup is in progress.
+  struct search_path {
+    const macro_table *table;
+    const search_path *next;
+  };
+
+  // Generations of a table and of all the included tables, at the time some data was
+  // derived from them. The snapshot shares the generation counters, so it can be checked
+  // after the tables are destroyed.
+  struct snapshot {
+    explicit snapshot(const macro_table *);
+    bool is_current() const;
+
+    std::vector<std::pair<std::shared_ptr<const size_t>, size_t>> tables;
+    // Global generation, at which the snapshot was last known to be current.
+    mutable std::atomic<size_t> verified;
   };
 
-  class entry {
-  public:
-    entry();
-    void destroy();
+  // Directives of a table, merged with the definitions from the included tables.
+  struct flat_view {
+    explicit flat_view(const macro_table *t) : tables(t) {}
 
-    enum { INVALID, DEFINE, UNDEFINE, INCLUDE } kind;
+    std::unordered_map<detail::symbol, std::vector<version>> index;
+    snapshot tables;
+  };
+
+  const define *find_define(unsigned int, detail::symbol, const search_path *) const;
+  const flat_view *get_flat_view() const;
+  const detail::name_filter *get_filter() const;
+  static std::vector<const macro_table *> reachable(const macro_table *);
+  void add_entry(unsigned int, kind, const void *);
+  const char *copy_text(const char *, size_t);
+  void index_name(unsigned int, detail::symbol, const define *);
+  size_t content_hash() const;
+  bool same_directives(const macro_table &) const;
+  // Directives in line order, as parallel arrays of line numbers, kinds and pointers to
+  // the define, undefine or included_macros objects.
+  std::vector<unsigned int> lines_;
+  std::vector<kind> kinds_;
+  std::vector<const void *> items_;
+  std::deque<define> defines_;
+  std::deque<undefine> undefines_;
+  // Text of the directives.
+  std::unique_ptr<detail::arena> text_;
+  // Line-ordered history of the define/undefine directives for each name.
+  std::unordered_map<detail::symbol, std::vector<version>> index_;
+  // Line-ordered include directives.
+  std::vector<include_version> includes_;
+  // Number of modifications of the table. Destruction of the table counts as one.
+  std::shared_ptr<size_t> generation_;
+  std::unique_ptr<flat_view> flat_;
+  // Included tables, owned jointly with other tables.
+  std::vector<std::shared_ptr<const included_macros>> shared_includes_;
+  // Filter of the defined names, created on first use and recreated after
+  // modifications. Filters, replaced after modifications of the included tables, are
+  // kept until this table is modified, as concurrent lookups may still check them.
+  mutable std::atomic<const detail::name_filter *> filter_;
+  mutable std::vector<std::unique_ptr<const detail::name_filter>> filters_;
+  mutable std::mutex filter_mutex_;
+};
+
+// Builder of a macro table from directives in any line order. The directives are sorted
+// once, and their text is copied once, into the memory of the table.
+class macro_table_builder {
+public:
+  _LIBMACRO_EXPORT macro_table_builder();
+  _LIBMACRO_EXPORT ~macro_table_builder();
+
+  _LIBMACRO_EXPORT void add_define(unsigned int, const std::string &);
+  _LIBMACRO_EXPORT void add_undefine(unsigned int, const std::string &);
+  _LIBMACRO_EXPORT void add_include(unsigned int, const included_macros *);
+
+  // Add directives from character sequences, which need not be null-terminated.
+  _LIBMACRO_EXPORT void add_define(unsigned int, const char *, size_t);
+  _LIBMACRO_EXPORT void add_undefine(unsigned int, const char *, size_t);
+
+  // Create a table with the directives, added so far, and clear the builder.
+  _LIBMACRO_EXPORT std::unique_ptr<macro_table> build();
+
+  size_t
+  size() const {
+    return records_.size();
+  }
+
+private:
+  struct record {
     unsigned int lineno;
-    union {
-      define *def;
-      undefine *undef;
-      const included_macros *include;
-    };
+    enum { DEFINE, UNDEFINE, INCLUDE } kind;
+    const char *text;
+    size_t size;
+    const included_macros *include;
+  };
+
+  std::vector<record> records_;
+  // Text of the directives, passed to the table.
+  std::unique_ptr<detail::arena> text_;
+};
+
+// Registry of tables, identified by their directives. Tables with the same sequence of
+// directives, including the same instances of included tables, are shared, so each
+// distinct table is kept once. Registered tables must not be modified.
+class macro_table_registry {
+public:
+  _LIBMACRO_EXPORT macro_table_registry();
+  _LIBMACRO_EXPORT ~macro_table_registry();
+  macro_table_registry(const macro_table_registry &) = delete;
+  macro_table_registry &operator=(const macro_table_registry &) = delete;
+
+  // Get the registered table with the same directives as TABLE, registering TABLE if
+  // there is none. A table stays registered while it is in use.
+  _LIBMACRO_EXPORT std::shared_ptr<const included_macros> intern(
+      std::unique_ptr<macro_table> table);
+
+  // Get the number of registered tables in use.
+  _LIBMACRO_EXPORT size_t size() const;
+
+private:
+  class shared_table;
+
+  mutable std::mutex mutex_;
+  // Registered tables, by the hash of their directives.
+  std::unordered_map<size_t, std::vector<std::weak_ptr<const shared_table>>> tables_;
+};
+
+// The macro definitions, visible at a particular line of a table. Later modifications of
+// the table or of the included tables are not reflected.
+class macro_scope {
+public:
+  _LIBMACRO_EXPORT macro_scope(const macro_table *, unsigned int lineno);
+  _LIBMACRO_EXPORT ~macro_scope();
+  macro_scope(const macro_scope &) = delete;
+  macro_scope &operator=(const macro_scope &) = delete;
+
+  _LIBMACRO_EXPORT const macro_table::define *find_define(string_ref) const;
+
+  const macro_table::define *
+  find_define(detail::symbol sym) const {
+    auto i = defs_.find(sym);
+    return i == defs_.end() ? nullptr : i->second.def;
+  }
+
+  // Get the complete expansion of an object-like macro, created on first use.
+  const detail::object_expansion &get_expansion(detail::symbol) const;
+
+  // Get the number of visible macro definitions.
+  size_t
+  size() const {
+    return defs_.size();
+  }
+
+private:
+  struct binding {
+    explicit binding(const macro_table::define *d) : def(d), expansion(nullptr) {}
+
+    const macro_table::define *def;
+    mutable std::atomic<detail::object_expansion *> expansion;
   };
 
-  entry *make_entry(unsigned int);
-  std::vector<entry> table_;
-  mutable bool in_use_;
+  std::unordered_map<detail::symbol, binding> defs_;
+};
+
+// Counts of the identifiers, looked up as macro names.
+struct lookup_stats {
+  // Identifiers, found not to be macro names by the table filter.
+  unsigned long long filtered;
+  // Identifiers, searched for in the table.
+  unsigned long long searched;
 };
 
-std::string macro_expand(const std::string &input,
+namespace detail {
+// Source of macro definitions, other than a table or a scope, e.g. a table in an image.
+class definition_source {
+public:
+  virtual ~definition_source() {}
+
+  virtual const macro_table::define *find_define(string_ref name) const = 0;
+};
+}  // end namespace detail
+
+// Receiver of the result of a macro expansion, passed in pieces.
+class expansion_sink {
+public:
+  virtual ~expansion_sink() {}
+
+  // Prepare for receiving the given number of characters more.
+  virtual void
+  reserve(size_t) {}
+
+  virtual void write(const char *, size_t) = 0;
+};
+
+// Sink, appending the result to a string.
+class string_sink : public expansion_sink {
+public:
+  explicit string_sink(std::string &s) : str_(s) {}
+
+  void
+  reserve(size_t size) override {
+    str_.reserve(str_.size() + size);
+  }
+
+  void
+  write(const char *p, size_t size) override {
+    str_.append(p, size);
+  }
+
+private:
+  std::string &str_;
+};
+
+// Sink, storing the result in a buffer. The result is truncated, if it does not fit, and
+// is not null-terminated.
+class buffer_sink : public expansion_sink {
+public:
+  buffer_sink(char *buffer, size_t size) : buffer_(buffer), capacity_(size), size_(0) {}
+
+  void
+  write(const char *p, size_t size) override {
+    if (size_ < capacity_)
+      std::memcpy(buffer_ + size_, p, std::min(size, capacity_ - size_));
+    size_ += size;
+  }
+
+  // Get the length of the result, which may exceed the size of the buffer.
+  size_t
+  size() const {
+    return size_;
+  }
+
+  bool
+  truncated() const {
+    return size_ > capacity_;
+  }
+
+private:
+  char *buffer_;
+  size_t capacity_;
+  size_t size_;
+};
+
+// Macro expansion context. Memory, allocated during an expansion, is kept for reuse by
+// the subsequent expansions in the same context.
+class expansion_context {
+public:
+  _LIBMACRO_EXPORT expansion_context();
+  _LIBMACRO_EXPORT ~expansion_context();
+  expansion_context(const expansion_context &) = delete;
+  expansion_context &operator=(const expansion_context &) = delete;
+
+  // Macro expand INPUT, using the macros, visible at line LINENO, and store the result
+  // in OUT.
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const macro_table *macros,
+                               unsigned int lineno,
+                               std::string &out);
+
+  // Macro expand INPUT, using the macros, visible in SCOPE, and store the result in OUT.
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const macro_scope &scope,
+                               std::string &out);
+
+  // Macro expand INPUT, using the macros, visible at line LINENO of table TABLE of
+  // IMAGE, and store the result in OUT. Defined by the image module.
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const macro_image &image,
+                               size_t table,
+                               unsigned int lineno,
+                               std::string &out);
+
+  // Macro expand INPUT, as above, and pass the result to OUT.
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const macro_table *macros,
+                               unsigned int lineno,
+                               expansion_sink &out);
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const macro_scope &scope,
+                               expansion_sink &out);
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const macro_image &image,
+                               size_t table,
+                               unsigned int lineno,
+                               expansion_sink &out);
+
+  // Release the memory, used by the last expansion, for reuse.
+  _LIBMACRO_EXPORT void reset();
+
+  // Get the names, looked up as macros by the last expansion. The expansion depends only
+  // on their definitions.
+  _LIBMACRO_EXPORT const std::vector<detail::symbol> &dependencies() const;
+
+  // Get the counts of the macro name lookups, done by all the expansions in the context.
+  _LIBMACRO_EXPORT const lookup_stats &stats() const;
+
+private:
+  // Macro expand INPUT, using the macros from SOURCE.
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const detail::definition_source &source,
+                               std::string &out);
+  _LIBMACRO_EXPORT void expand(string_ref input,
+                               const detail::definition_source &source,
+                               expansion_sink &out);
+
+  detail::expander *impl_;
+};
+
+// Bounded cache of macro expansion results, with least recently used entries evicted
+// first. A result is reused at the lines, where the macros it depends on have the same
+// definitions, until the table or any of the included tables is modified or destroyed.
+class expansion_cache {
+public:
+  _LIBMACRO_EXPORT explicit expansion_cache(size_t capacity);
+  _LIBMACRO_EXPORT ~expansion_cache();
+  expansion_cache(const expansion_cache &) = delete;
+  expansion_cache &operator=(const expansion_cache &) = delete;
+
+  // Get the result of the macro expansion of INPUT, using the macros, visible at line
+  // LINENO. The reference is valid until the next call.
+  _LIBMACRO_EXPORT const std::string &expand(string_ref input,
+                                             const macro_table *macros,
+                                             unsigned int lineno);
+
+  // Remove all entries.
+  _LIBMACRO_EXPORT void clear();
+
+  size_t
+  size() const {
+    return entries_.size();
+  }
+
+  // Get the number of expansions, served from the cache and computed, respectively.
+  unsigned long long
+  hits() const {
+    return hits_;
+  }
+
+  unsigned long long
+  misses() const {
+    return misses_;
+  }
+
+private:
+  struct entry {
+    std::string input;
+    const macro_table *macros;
+    macro_table::line_range lines;
+    std::shared_ptr<const macro_table::snapshot> tables;
+    std::string output;
+  };
+
+  size_t capacity_;
+  // Entries, most recently used first.
+  std::list<entry> entries_;
+  // Entries, by the hash of the input.
+  std::unordered_map<size_t, std::vector<std::list<entry>::iterator>> index_;
+  // Current snapshot of each table.
+  std::unordered_map<const macro_table *, std::shared_ptr<const macro_table::snapshot>>
+      tables_;
+  expansion_context context_;
+  unsigned long long hits_;
+  unsigned long long misses_;
+};
+
+std::string macro_expand(string_ref input,
                          const macro_table *macros,
                          unsigned int lineno);
+
+std::string macro_expand(string_ref input, const macro_scope &scope);
+
+// Macro expand INPUT and pass the result to OUT.
+void macro_expand(string_ref input,
+                  const macro_table *macros,
+                  unsigned int lineno,
+                  expansion_sink &out);
+
+void macro_expand(string_ref input, const macro_scope &scope, expansion_sink &out);
 }  // end namespace
 #endif  // libmacro_hh__
@@ -2,15 +2,122 @@
 #ifndef libmacro_tokenize_hh__
 #define libmacro_tokenize_hh__ 1
 
+#include "libmacro.hh"
+#include "arena.hh"
 #include <string>
 #include <vector>
-#include <locale>
+#include <list>
+#include <iterator>
 #include <cassert>
+#include <cstring>
 
 namespace libmacro {
 namespace detail {
 
-extern std::locale C_locale;
+// Character classes. Only the "C" locale is supported.
+enum { CC_SPACE = 1, CC_DIGIT = 2, CC_ALPHA = 4, CC_XDIGIT = 8 };
+
+// Get the class of a character.
+constexpr unsigned char
+classify(unsigned int ch) {
+  return ch == ' ' || (ch >= '\t' && ch <= '\r') ? CC_SPACE
+         : ch >= '0' && ch <= '9' ? CC_DIGIT | CC_XDIGIT
+         : (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F') ? CC_ALPHA | CC_XDIGIT
+         : (ch >= 'g' && ch <= 'z') || (ch >= 'G' && ch <= 'Z') ? CC_ALPHA
+                                                                : 0;
+}
+
+// Character class table.
+#define LIBMACRO_CC_ROW(n)                                                               \
+  classify(n), classify(n + 1), classify(n + 2), classify(n + 3), classify(n + 4),      \
+      classify(n + 5), classify(n + 6), classify(n + 7), classify(n + 8),               \
+      classify(n + 9), classify(n + 10), classify(n + 11), classify(n + 12),            \
+      classify(n + 13), classify(n + 14), classify(n + 15)
+constexpr unsigned char char_class[256] = {
+    LIBMACRO_CC_ROW(0x00),
+    LIBMACRO_CC_ROW(0x10),
+    LIBMACRO_CC_ROW(0x20),
+    LIBMACRO_CC_ROW(0x30),
+    LIBMACRO_CC_ROW(0x40),
+    LIBMACRO_CC_ROW(0x50),
+    LIBMACRO_CC_ROW(0x60),
+    LIBMACRO_CC_ROW(0x70),
+    LIBMACRO_CC_ROW(0x80),
+    LIBMACRO_CC_ROW(0x90),
+    LIBMACRO_CC_ROW(0xa0),
+    LIBMACRO_CC_ROW(0xb0),
+    LIBMACRO_CC_ROW(0xc0),
+    LIBMACRO_CC_ROW(0xd0),
+    LIBMACRO_CC_ROW(0xe0),
+    LIBMACRO_CC_ROW(0xf0),
+};
+#undef LIBMACRO_CC_ROW
+
+inline bool
+isspace(char ch) {
+  return char_class[static_cast<unsigned char>(ch)] & CC_SPACE;
+}
+
+inline bool
+isdigit(char ch) {
+  return char_class[static_cast<unsigned char>(ch)] & CC_DIGIT;
+}
+
+inline bool
+isxdigit(char ch) {
+  return char_class[static_cast<unsigned char>(ch)] & CC_XDIGIT;
+}
+
+inline bool
+isalpha(char ch) {
+  return char_class[static_cast<unsigned char>(ch)] & CC_ALPHA;
+}
+
+inline bool
+isalnum(char ch) {
+  return char_class[static_cast<unsigned char>(ch)] & (CC_ALPHA | CC_DIGIT);
+}
+
+// Check if a character can start an identifier.
+inline bool
+isidstart(char ch) {
+  return ch == '_' || isalpha(ch);
+}
+
+// Check if a character can continue an identifier.
+inline bool
+isidchar(char ch) {
+  return ch == '_' || isalnum(ch);
+}
+
+using libmacro::string_ref;
+
+// FNV-1a hash of a character sequence.
+struct string_ref_hash {
+  size_t
+  operator()(string_ref s) const {
+    size_t h = 2166136261u;
+    for (auto ch : s) {
+      h ^= static_cast<unsigned char>(ch);
+      h *= 16777619u;
+    }
+    return h;
+  }
+};
+
+// Copy a character sequence into an arena.
+template<typename InputIterator>
+string_ref
+copy_text(arena &text, InputIterator begin, InputIterator end) {
+  auto size = std::distance(begin, end);
+  return string_ref(text.copy(begin, size), size);
+}
+
+// Get the symbol for an identifier, interning the identifier if necessary.
+symbol intern(string_ref);
+
+// Get the symbol for an identifier, or zero if the identifier was never interned.
+symbol find_symbol(string_ref);
 
 inline bool
 isoctal(char ch) {
@@ -35,9 +142,9 @@ scan_oct_seq(InputIterator str, InputIterator end) {
 template<typename InputIterator>
 InputIterator
 scan_hex_seq(InputIterator str, InputIterator end) {
-  assert(str != end && std::isxdigit(*str, C_locale));
+  assert(str != end && isxdigit(*str));
   ++str;
-  if (str != end && std::isxdigit(*str, C_locale))
+  if (str != end && isxdigit(*str))
     ++str;
   return str;
 }
@@ -146,7 +253,7 @@ scan_string_literal(InputIterator str, InputIterator end) {
 template<typename InputIterator>
 InputIterator
 scan_pp_number(InputIterator str, InputIterator end) {
-  assert(str != end && std::isdigit(*str, C_locale));
+  assert(str != end && isdigit(*str));
   while (str != end) {
     if (*str == 'e' || *str == 'E' || *str == 'p' || *str == 'P') {
       auto next = str;
@@ -154,8 +261,7 @@ scan_pp_number(InputIterator str, InputIterator end) {
       if (next != end && (*next == '+' || *next == '-'))
         str = next;
       ++str;
-    } else if (std::isdigit(*str, C_locale) || std::isalpha(*str, C_locale)
-               || *str == '.') {
+    } else if (isdigit(*str) || isalpha(*str) || *str == '.') {
       ++str;
     } else {
       break;
@@ -167,53 +273,27 @@ scan_pp_number(InputIterator str, InputIterator end) {
 struct token {
   enum kind { ID, STRINGIFY, PASTE, PLACEMARKER, END, OTHER };
 
-  token(enum kind k, bool ws) : kind(k), ws(ws), noexpand(false), pop(0) {}
-
-  template<typename It>
-  token(enum kind k, bool ws, It begin, It end)
-      : kind(k), ws(ws), noexpand(false), pop(), text(begin, end) {}
-
-  token(const token &other)
-      : kind(other.kind),
-        ws(other.ws),
-        noexpand(other.noexpand),
-        pop(other.pop),
-        text(other.text) {}
-
-  token(token &&other)
-      : kind(other.kind),
-        ws(other.ws),
-        noexpand(other.noexpand),
-        pop(other.pop),
-        text(std::move(other.text)) {}
-
-  token &
-  operator=(const token &other) {
-    token tmp(other);
-    std::swap(*this, tmp);
-    return *this;
-  }
+  token(enum kind k, bool ws) : kind(k), ws(ws), noexpand(false), pop(0), sym(0) {}
 
-  token &
-  operator=(token &&other) {
-    kind = other.kind;
-    ws = other.ws;
-    noexpand = other.noexpand;
-    pop = other.pop;
-    text = std::move(other.text);
-    return *this;
-  }
+  token(enum kind k, bool ws, string_ref text)
+      : kind(k), ws(ws), noexpand(false), pop(0), sym(0), text(text) {}
 
   enum kind kind;
   bool ws;
   bool noexpand;
   size_t pop;
-  std::string text;
+  // Symbol of an identifier.
+  symbol sym;
+  string_ref text;
 };
 
 // Type for a list of tokens.
 typedef std::vector<token> token_list;
 
+// Type for a list of tokens, undergoing macro replacement. Replacing a macro invocation
+// with its expansion takes time, proportional to the length of the expansion only.
+typedef std::list<token, arena_allocator<token>> token_stream;
+
 // Scan a preprocessing token
 // preprocessing-token:
 //     header-name
@@ -228,7 +308,7 @@ InputIterator
 scan_pp_token(InputIterator str, InputIterator end, enum token::kind &kind, size_t &ws) {
   // Advance past the leading whitespace.
   ws = 0;
-  while (str != end && std::isspace(*str, C_locale)) {
+  while (str != end && isspace(*str)) {
     ++ws;
     ++str;
   }
@@ -239,7 +319,7 @@ scan_pp_token(InputIterator str, InputIterator end, enum token::kind &kind, size
   }
 
   kind = token::OTHER;
-  if (std::isdigit(*str, C_locale)) {
+  if (isdigit(*str)) {
     // Scan pp-number
     return scan_pp_number(str, end);
   } else if (*str == '\'') {
@@ -248,11 +328,11 @@ scan_pp_token(InputIterator str, InputIterator end, enum token::kind &kind, size
   } else if (*str == '"') {
     // Scan string literal.
     return scan_string_literal(str, end);
-  } else if (*str == '_' || std::isalpha(*str, C_locale)) {
+  } else if (isidstart(*str)) {
     // Scan identifier.
     kind = token::ID;
     ++str;
-    while (str != end && (*str == '_' || std::isalnum(*str, C_locale)))
+    while (str != end && isidchar(*str))
       ++str;
     return str;
   }
@@ -269,7 +349,7 @@ scan_pp_token(InputIterator str, InputIterator end, enum token::kind &kind, size
   case '?':
   case ',':
   case ';':
-    assert(!std::isspace(*str, C_locale));
+    assert(!isspace(*str));
     ++str;
     break;
   case '-':
@@ -346,7 +426,7 @@ scan_pp_token(InputIterator str, InputIterator end, enum token::kind &kind, size
   case '.':
     ++str;
     if (str != end) {
-      if (std::isdigit(*str, C_locale))
+      if (isdigit(*str))
         str = scan_pp_number(str, end);
       else if (end - str > 1 && *str == '.' && *(str + 1) == '.')
         str += 2;
@@ -364,10 +444,11 @@ scan_pp_token(InputIterator str, InputIterator end, enum token::kind &kind, size
   return str;
 }
 
-template<typename It>
+// Tokenizer of a character sequence. The tokens reference the character sequence, which
+// must outlive them.
 class tokenizer {
 public:
-  tokenizer(It begin, It end, bool func_like, bool repl = true)
+  tokenizer(const char *begin, const char *end, bool func_like, bool repl)
       : token_(token::END, false),
         next_(begin),
         end_(end),
@@ -377,7 +458,7 @@ public:
   class iterator {
   public:
     explicit iterator() : owner_(nullptr) {}
-    explicit iterator(tokenizer<It> *owner) : owner_(owner) {
+    explicit iterator(tokenizer *owner) : owner_(owner) {
       const auto &t = owner_->fetch();
       if (t.kind == token::END)
         owner_ = nullptr;
@@ -411,7 +492,7 @@ public:
     }
 
   private:
-    tokenizer<It> *owner_;
+    tokenizer *owner_;
   };
 
   iterator
@@ -429,15 +510,14 @@ private:
   friend class iterator;
 
   token token_;
-  It next_;
-  It end_;
+  const char *next_;
+  const char *end_;
   bool func_like_;
   bool replacement_;
 };
 
-template<typename It>
-const token &
-tokenizer<It>::fetch() {
+inline const token &
+tokenizer::fetch() {
   enum token::kind kind;
   size_t ws;
   if (next_ == end_)
@@ -450,16 +530,21 @@ tokenizer<It>::fetch() {
   assert(kind != token::PLACEMARKER);
   switch (kind) {
   case token::ID:
+    token_ = {kind, ws != 0, string_ref(start + ws, next - start - ws)};
+    // Identifiers in a replacement list are interned, as they may become macro names
+    // later. Other identifiers, which are not yet interned, cannot be macro names.
+    token_.sym = replacement_ ? intern(token_.text) : find_symbol(token_.text);
+    return token_;
   case token::OTHER:
-    return token_ = {kind, ws != 0, start + ws, next};
+    return token_ = {kind, ws != 0, string_ref(start + ws, next - start - ws)};
   case token::STRINGIFY:
     if (!replacement_ || !func_like_)
-      return token_ = {token::OTHER, ws != 0, start + ws, next};
+      return token_ = {token::OTHER, ws != 0, string_ref(start + ws, next - start - ws)};
     else
       return token_ = {kind, ws != 0};
   case token::PASTE:
     if (!replacement_)
-      return token_ = {token::OTHER, ws != 0, start + ws, next};
+      return token_ = {token::OTHER, ws != 0, string_ref(start + ws, next - start - ws)};
     else
       return token_ = {kind, ws != 0};
   default:
@@ -468,21 +553,29 @@ tokenizer<It>::fetch() {
   }
 }
 
-// Tokenize a character sequence
-template<typename InputIterator>
-token_list
-tokenize(InputIterator begin,
-         InputIterator end,
+// Tokenize a character sequence, appending the tokens to a container. The tokens
+// reference the character sequence.
+template<typename Container>
+void
+tokenize(const char *begin,
+         const char *end,
          bool func_like,
-         bool replacement = true) {
-  token_list tokens;
-  tokenizer<InputIterator> t(begin, end, func_like, replacement);
+         bool replacement,
+         Container &tokens) {
+  tokenizer t(begin, end, func_like, replacement);
   const auto stop = t.end();
   auto curr = t.begin();
   while (curr != stop) {
     tokens.push_back(*curr);
     ++curr;
   }
+}
+
+// Tokenize a character sequence
+inline token_list
+tokenize(const char *begin, const char *end, bool func_like, bool replacement) {
+  token_list tokens;
+  tokenize(begin, end, func_like, replacement, tokens);
   return tokens;
 }
 